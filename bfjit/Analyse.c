@@ -0,0 +1,173 @@
+#include "extern_data.h"
+#include "Analyse.h"
+#include <stdlib.h>
+
+typedef struct interval_s
+{
+	int64_t low;
+	int64_t high;
+} interval_t;
+
+static void analyseBlock( const opcode_t* code, const int* jumps, int begin, int end, interval_t* pointer, interval_t* access );
+static void touch( interval_t* access, interval_t pointer, int64_t offset );
+static interval_t shift( interval_t interval, int64_t low, int64_t high );
+static int64_t addSaturate( int64_t a, int64_t b );
+
+void analyseTapeRange( const opcode_t* code, tapeRange_t* range )
+{
+	int opcodesCount = 0;
+	while ( code[opcodesCount].type != OP_CODE_END )
+	{
+		opcodesCount++;
+	}
+
+	int* jumps = malloc( (opcodesCount + 1) * sizeof( int ) );
+	int* bracketStack = malloc( MAX_STACK_SIZE * sizeof( int ) );
+	int bracketStackIndex = 0;
+	for ( int i = 0; i < opcodesCount; i++ )
+	{
+		if ( code[i].type == OP_OPEN_BRACKET )
+		{
+			bracketStack[bracketStackIndex++] = i;
+		}
+		else if ( code[i].type == OP_CLOSE_BRACKET )
+		{
+			jumps[bracketStack[--bracketStackIndex]] = i;
+		}
+	}
+	free( bracketStack );
+
+	interval_t pointer = { 0, 0 };
+	interval_t access = { RANGE_UNBOUNDED_HIGH, RANGE_UNBOUNDED_LOW }; //Empty.
+	analyseBlock( code, jumps, 0, opcodesCount, &pointer, &access );
+	free( jumps );
+
+	if ( access.low > access.high )
+	{
+		//Never touches the tape, one cell keeps everyone happy.
+		access.low = 0;
+		access.high = 0;
+	}
+
+	range->minimum = access.low;
+	range->maximum = access.high;
+}
+
+void analyseBlock( const opcode_t* code, const int* jumps, int begin, int end, interval_t* pointer, interval_t* access )
+{
+	for ( int i = begin; i < end; i++ )
+	{
+		switch ( code[i].type )
+		{
+		case OP_INC_PTR:
+			*pointer = shift( *pointer, 1, 1 );
+			break;
+		case OP_DEC_PTR:
+			*pointer = shift( *pointer, -1, -1 );
+			break;
+		case OP_ADD_PTR:
+			*pointer = shift( *pointer, code[i].value, code[i].value );
+			break;
+		case OP_SUB_PTR:
+			*pointer = shift( *pointer, -(int64_t)code[i].value, -(int64_t)code[i].value );
+			break;
+		case OP_OUTPUT_CONST:
+			break;
+		case OP_SCAN_RIGHT:
+			//Reads every cell up to wherever the zero is.
+			pointer->high = RANGE_UNBOUNDED_HIGH;
+			touch( access, *pointer, 0 );
+			break;
+		case OP_SCAN_LEFT:
+			pointer->low = RANGE_UNBOUNDED_LOW;
+			touch( access, *pointer, 0 );
+			break;
+		case OP_VECTOR_SET:
+		case OP_VECTOR_ADD:
+			touch( access, *pointer, code[i].offset );
+			touch( access, *pointer, code[i].offset + VECTOR_CELLS - 1 );
+			break;
+		case OP_OPEN_BRACKET:
+			{
+				int close = jumps[i];
+				touch( access, *pointer, 0 );
+
+				//Body on its own, relative to where each iteration starts.
+				interval_t bodyPointer = { 0, 0 };
+				interval_t bodyAccess = { RANGE_UNBOUNDED_HIGH, RANGE_UNBOUNDED_LOW };
+				analyseBlock( code, jumps, i + 1, close, &bodyPointer, &bodyAccess );
+				touch( &bodyAccess, bodyPointer, 0 );
+
+				if ( bodyPointer.low != 0 || bodyPointer.high != 0 )
+				{
+					//The body moves the pointer, any number of iterations can drift it
+					//without limit in the direction(s) it moves.
+					interval_t reachable = *pointer;
+					if ( bodyPointer.high > 0 )
+					{
+						reachable.high = RANGE_UNBOUNDED_HIGH;
+					}
+					if ( bodyPointer.low < 0 )
+					{
+						reachable.low = RANGE_UNBOUNDED_LOW;
+					}
+					*pointer = reachable;
+				}
+
+				//Every iteration starts somewhere in pointer.
+				interval_t loopAccess = shift( *pointer, bodyAccess.low, bodyAccess.high );
+				touch( access, loopAccess, 0 );
+
+				i = close;
+			}
+			break;
+		default:
+			//Everything else works on a cell.
+			touch( access, *pointer, code[i].offset );
+			break;
+		}
+	}
+}
+
+void touch( interval_t* access, interval_t pointer, int64_t offset )
+{
+	interval_t cells = shift( pointer, offset, offset );
+	if ( cells.low < access->low )
+	{
+		access->low = cells.low;
+	}
+	if ( cells.high > access->high )
+	{
+		access->high = cells.high;
+	}
+}
+
+interval_t shift( interval_t interval, int64_t low, int64_t high )
+{
+	interval_t shifted;
+	shifted.low = addSaturate( interval.low, low );
+	shifted.high = addSaturate( interval.high, high );
+	return shifted;
+}
+
+int64_t addSaturate( int64_t a, int64_t b )
+{
+	//Unbounded stays unbounded, everything else clamps before it can wrap.
+	if ( a == RANGE_UNBOUNDED_LOW || b == RANGE_UNBOUNDED_LOW )
+	{
+		return RANGE_UNBOUNDED_LOW;
+	}
+	if ( a == RANGE_UNBOUNDED_HIGH || b == RANGE_UNBOUNDED_HIGH )
+	{
+		return RANGE_UNBOUNDED_HIGH;
+	}
+	if ( b > 0 && a > RANGE_UNBOUNDED_HIGH - b )
+	{
+		return RANGE_UNBOUNDED_HIGH;
+	}
+	if ( b < 0 && a < RANGE_UNBOUNDED_LOW - b )
+	{
+		return RANGE_UNBOUNDED_LOW;
+	}
+	return a + b;
+}
@@ -0,0 +1,8 @@
+#pragma once
+#ifndef ANALYSE_H
+#define ANALYSE_H
+
+//Works out which cells, relative to where the pointer starts, the program can touch.
+extern void analyseTapeRange( const opcode_t* code, tapeRange_t* range );
+
+#endif
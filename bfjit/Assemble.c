@@ -1,153 +1,515 @@
 #include "extern_data.h"
 #include "Assemble.h"
+#include "Cpu.h"
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "InstructionSet.h"
+#include "Encode.h"
 #include <assert.h>
+#include <Windows.h>
 
-#define MAX_CODE_SIZE 1000000
+//Below this many opcodes threads cost more than they save.
+#define PARALLEL_MIN_OPCODES 100000
 
+//Chunks per worker, so one long loop does not leave the other workers idle.
+#define CHUNKS_PER_WORKER 4
 
-static instruction_t instructionSet[OP_CODE_END];
+typedef struct chunk_s
+{
+	const opcode_t* code;
+	int begin; //first opcode of the chunk
+	int end; //one past the last opcode of the chunk
+	int flags;
+
+	unsigned char* machineCode;
+	int size;
 
-static size_t getSize( OpType type );
-static void setupInstructionSetTable();
+	//Code offsets of jumps to the limit exit, relative to the chunk start.
+	int* limitFixups;
+	int limitFixupsCount;
+} chunk_t;
 
-unsigned char* assemble( const opcode_t* code, int* size )
+typedef struct chunkQueue_s
 {
-	setupInstructionSetTable();
+	chunk_t* chunks;
+	int count;
+	volatile LONG next;
+} chunkQueue_t;
 
-	//Assign some memory for our machine code
-	unsigned char* machineCode = malloc( MAX_CODE_SIZE );
+//Scan loop code for the CPU level, fixed bytes the encoder copies in.
+static const unsigned char* s_scanRight;
+static int s_scanRightSize;
+static const unsigned char* s_scanLeft;
+static int s_scanLeftSize;
 
-	//Init bracketStack for recording bracket positions.
-	int* bracketStack = malloc( MAX_STACK_SIZE * sizeof( int ) );
-	int bracketStackIndex = 0;
+#define setScan(right_array, left_array) \
+s_scanRight = right_array; \
+s_scanRightSize = sizeof(right_array); \
+s_scanLeft = left_array; \
+s_scanLeftSize = sizeof(left_array);
+
+//Vector ops over two neighbouring blocks of cells become one AVX2 op when the level allows.
+static int s_wideVectors;
+
+static void setupInstructionSetTable( CpuLevel level );
+
+static chunk_t* splitChunks( const opcode_t* code, int flags, int workers, int* count );
+static void assembleChunk( chunk_t* chunk );
+static DWORD WINAPI assembleWorker( LPVOID parameter );
+static int getWorkerCount();
+
+unsigned char* assemble( const opcode_t* code, int* size, int flags )
+{
+	setupInstructionSetTable( getCpuLevel() );
+
+	int workers = getWorkerCount();
+	int chunksCount;
+	chunk_t* chunks = splitChunks( code, flags, workers, &chunksCount );
+
+	if ( workers > chunksCount )
+	{
+		workers = chunksCount;
+	}
+
+	if ( workers > 1 )
+	{
+		chunkQueue_t queue;
+		queue.chunks = chunks;
+		queue.count = chunksCount;
+		queue.next = 0;
+
+		HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+		int threadsCount = 0;
+		for ( int i = 1; i < workers; i++ )
+		{
+			threads[threadsCount] = CreateThread( NULL, 0, assembleWorker, &queue, 0, NULL );
+			if ( threads[threadsCount] )
+			{
+				threadsCount++;
+			}
+		}
+
+		//The calling thread works too, it also picks up everything if no thread started.
+		assembleWorker( &queue );
+
+		if ( threadsCount )
+		{
+			WaitForMultipleObjects( threadsCount, threads, TRUE, INFINITE );
+		}
+		for ( int i = 0; i < threadsCount; i++ )
+		{
+			CloseHandle( threads[i] );
+		}
+	}
+	else
+	{
+		for ( int i = 0; i < chunksCount; i++ )
+		{
+			assembleChunk( &chunks[i] );
+		}
+	}
+
+	//Assign some memory for our machine code
+	size_t codeSize = sizeof( op_header ) + sizeof( op_jmpShort ) + sizeof( uint8_t )
+		+ sizeof( op_returnTapeOverflow ) + sizeof( op_footer ) + sizeof( op_returnOk ) + sizeof( op_footer );
+	if ( flags & ASM_FUEL_CHECKS )
+	{
+		codeSize += sizeof( op_returnLimitReached ) + sizeof( op_footer );
+	}
+	for ( int i = 0; i < chunksCount; i++ )
+	{
+		codeSize += chunks[i].size;
+	}
+	unsigned char* machineCode = malloc( codeSize );
 
-	
 	int codeIndex = 0;
 	memcpy_s( machineCode + codeIndex, sizeof( op_header ), op_header, sizeof( op_header ) );
 	codeIndex += sizeof( op_header );
 
-	for (int i = 0; code[i].type != OP_CODE_END; i++ )
+	//Put the exits straight after the header and jump over them, that way every fuel check
+	//jumps backwards to a known address and the tape fault handler finds its exit at a fixed offset.
+	uint8_t skip = sizeof( op_returnTapeOverflow ) + sizeof( op_footer );
+	if ( flags & ASM_FUEL_CHECKS )
 	{
-		instruction_t instruction = instructionSet[code[i].type];
-		//Copy the constant part of the instruction
-		memcpy_s( machineCode + codeIndex, instruction.size, instruction.opcode, instruction.size );
-		codeIndex += instruction.size;
+		skip += sizeof( op_returnLimitReached ) + sizeof( op_footer );
+	}
+	memcpy_s( machineCode + codeIndex, sizeof( op_jmpShort ), op_jmpShort, sizeof( op_jmpShort ) );
+	codeIndex += sizeof( op_jmpShort );
+	memcpy_s( machineCode + codeIndex, sizeof( uint8_t ), &skip, sizeof( uint8_t ) );
+	codeIndex += sizeof( uint8_t );
+
+	assert( codeIndex == getTapeOverflowExit() );
+	memcpy_s( machineCode + codeIndex, sizeof( op_returnTapeOverflow ), op_returnTapeOverflow, sizeof( op_returnTapeOverflow ) );
+	codeIndex += sizeof( op_returnTapeOverflow );
+	memcpy_s( machineCode + codeIndex, sizeof( op_footer ), op_footer, sizeof( op_footer ) );
+	codeIndex += sizeof( op_footer );
+
+	//Address of the exit taken when the fuel counter runs out.
+	int limitExitAddress = 0;
 
-		//If we have anything extra to add
-		if ( instruction.argument )
+	if ( flags & ASM_FUEL_CHECKS )
+	{
+		limitExitAddress = codeIndex;
+		memcpy_s( machineCode + codeIndex, sizeof( op_returnLimitReached ), op_returnLimitReached, sizeof( op_returnLimitReached ) );
+		codeIndex += sizeof( op_returnLimitReached );
+		memcpy_s( machineCode + codeIndex, sizeof( op_footer ), op_footer, sizeof( op_footer ) );
+		codeIndex += sizeof( op_footer );
+	}
+
+	//Stitch the chunks together. Bracket jumps never leave their chunk so they are
+	//position independent, only the jumps to the limit exit need relocating.
+	for ( int i = 0; i < chunksCount; i++ )
+	{
+		memcpy_s( machineCode + codeIndex, chunks[i].size, chunks[i].machineCode, chunks[i].size );
+
+		for ( int j = 0; j < chunks[i].limitFixupsCount; j++ )
 		{
-			if ( code[i].type == OP_CLOSE_BRACKET )
+			int fixupAddress = codeIndex + chunks[i].limitFixups[j];
+			uint32_t offset = limitExitAddress - fixupAddress - sizeof( uint32_t );
+			memcpy_s( machineCode + fixupAddress, sizeof( uint32_t ), &offset, sizeof( uint32_t ) );
+		}
+
+		codeIndex += chunks[i].size;
+
+		free( chunks[i].machineCode );
+		free( chunks[i].limitFixups );
+	}
+	free( chunks );
+
+	memcpy_s( machineCode + codeIndex, sizeof( op_returnOk ), op_returnOk, sizeof( op_returnOk ) );
+	codeIndex += sizeof( op_returnOk );
+	memcpy_s( machineCode + codeIndex, sizeof( op_footer ), op_footer, sizeof( op_footer ) );
+	codeIndex += sizeof( op_footer );
+
+	*size = codeIndex;
+
+	return machineCode;
+}
+
+int getTapeOverflowExit()
+{
+	return sizeof( op_header ) + sizeof( op_jmpShort ) + sizeof( uint8_t );
+}
+
+chunk_t* splitChunks( const opcode_t* code, int flags, int workers, int* count )
+{
+	int opcodesCount = 0;
+	while ( code[opcodesCount].type != OP_CODE_END )
+	{
+		opcodesCount++;
+	}
+
+	//Small programs or a single core, one chunk for everything.
+	int targetSize = opcodesCount;
+	if ( workers > 1 && opcodesCount >= PARALLEL_MIN_OPCODES )
+	{
+		targetSize = opcodesCount / (workers * CHUNKS_PER_WORKER);
+	}
+
+	int chunksCapacity = 16;
+	chunk_t* chunks = malloc( chunksCapacity * sizeof( chunk_t ) );
+	int chunksCount = 0;
+
+	//Bracket depth prefix scan, a chunk may only end where the depth returns to zero
+	//so every loop is assembled whole by one worker.
+	int depth = 0;
+	int begin = 0;
+	for ( int i = 0; i < opcodesCount; i++ )
+	{
+		if ( code[i].type == OP_OPEN_BRACKET )
+		{
+			depth++;
+		}
+		else if ( code[i].type == OP_CLOSE_BRACKET )
+		{
+			depth--;
+		}
+
+		if ( (depth == 0 && i + 1 - begin >= targetSize) || i + 1 == opcodesCount )
+		{
+			if ( chunksCount == chunksCapacity )
 			{
-				int openAddress = bracketStack[bracketStackIndex--];
-				uint32_t offset;
+				chunksCapacity *= 2;
+				chunks = realloc( chunks, chunksCapacity * sizeof( chunk_t ) );
+			}
 
-				if ( i >= 1 && code[i - 1].type == OP_ZERO )
-				{
-					//Optimisation remove jump from code if there is a zero instruction before.
-					//Bit hacky to have already copied in but we can just plop the codeIndex back the instruction
-					//size.
-					codeIndex -= instruction.size;
-				}
-				else
-				{
-					//This cell can be non-zero so jump is possible.
+			chunk_t* chunk = &chunks[chunksCount++];
+			chunk->code = code;
+			chunk->begin = begin;
+			chunk->end = i + 1;
+			chunk->flags = flags;
+			chunk->machineCode = NULL;
+			chunk->size = 0;
+			chunk->limitFixups = NULL;
+			chunk->limitFixupsCount = 0;
+
+			begin = i + 1;
+		}
+	}
 
-					offset = openAddress - codeIndex - sizeof( uint32_t ); //diff of jump backwards
-					//-sizeof(uint32_t) is to get to the int address we are writing to.
+	if ( chunksCount == 0 )
+	{
+		//Empty program, still hand back an empty chunk.
+		chunks[0].code = code;
+		chunks[0].begin = 0;
+		chunks[0].end = 0;
+		chunks[0].flags = flags;
+		chunks[0].machineCode = NULL;
+		chunks[0].size = 0;
+		chunks[0].limitFixups = NULL;
+		chunks[0].limitFixupsCount = 0;
+		chunksCount = 1;
+	}
 
-					//Copy jump offset into code
-					memcpy_s( machineCode + codeIndex, sizeof( uint32_t ), &offset, sizeof( uint32_t ) );
-					codeIndex += sizeof( uint32_t ); //advance the code index.
-				}
+	*count = chunksCount;
+	return chunks;
+}
 
+void assembleChunk( chunk_t* chunk )
+{
+	const opcode_t* code = chunk->code;
+	int flags = chunk->flags;
 
-				//Offset now is the jump forwards to after the close bracket instruction.
-				offset = codeIndex - openAddress;
-				//Write jump forwards into the open bracket address space
-				// - sizeof(uint32_t) is to get to the index where the int
-				//is to be placed.
-				memcpy_s( machineCode + openAddress - sizeof( uint32_t ), sizeof( uint32_t ), &offset, sizeof( uint32_t ) );
+	encoder_t encoder;
+	initEncoder( &encoder );
 
+	//Init bracketStack for recording the body label of every open bracket, its end label is the next one.
+	int* bracketStack = malloc( MAX_STACK_SIZE * sizeof( int ) );
+	int bracketStackIndex = 0;
+
+	operand_t pointer = registerOperand( REG_RBX, 8 );
+	operand_t cell = memoryOperand( REG_RBX, 0, 1 );
+	operand_t zero = immediateOperand( 0 );
+
+	//Closed form loops and ifs keep the trip count or mask in eax and products in ecx,
+	//nothing in between calls out.
+	operand_t count = registerOperand( REG_RAX, 4 );
+	operand_t mask = registerOperand( REG_RAX, 1 );
+	operand_t product = registerOperand( REG_RCX, 4 );
+	operand_t productByte = registerOperand( REG_RCX, 1 );
+
+	for ( int i = chunk->begin; i < chunk->end; i++ )
+	{
+		operand_t target = memoryOperand( REG_RBX, code[i].offset, 1 );
+		uint8_t value = code[i].value % 256;
+
+		switch ( code[i].type )
+		{
+		case OP_INC_PTR:
+			addInstruction( &encoder, X86_INC, pointer, noOperand() );
+			break;
+		case OP_DEC_PTR:
+			addInstruction( &encoder, X86_DEC, pointer, noOperand() );
+			break;
+		case OP_ADD_PTR:
+			addInstruction( &encoder, X86_ADD, pointer, immediateOperand( code[i].value ) );
+			break;
+		case OP_SUB_PTR:
+			addInstruction( &encoder, X86_SUB, pointer, immediateOperand( code[i].value ) );
+			break;
+		case OP_INC:
+			addInstruction( &encoder, X86_INC, cell, noOperand() );
+			break;
+		case OP_DEC:
+			addInstruction( &encoder, X86_DEC, cell, noOperand() );
+			break;
+		case OP_ADD:
+			addInstruction( &encoder, X86_ADD, cell, immediateOperand( value ) );
+			break;
+		case OP_SUB:
+			addInstruction( &encoder, X86_SUB, cell, immediateOperand( value ) );
+			break;
+		case OP_ZERO:
+			addInstruction( &encoder, X86_MOV, cell, zero );
+			break;
+		case OP_OUTPUT_CHAR:
+			addInstruction( &encoder, X86_MOVZX, registerOperand( REG_RCX, 4 ), cell );
+			addInstruction( &encoder, X86_CALL, registerOperand( REG_RSI, 8 ), noOperand() );
+			break;
+		case OP_INPUT_CHAR:
+			addInstruction( &encoder, X86_CALL, registerOperand( REG_RDI, 8 ), noOperand() );
+			addInstruction( &encoder, X86_MOV, cell, registerOperand( REG_RAX, 1 ) );
+			break;
+		case OP_OPEN_BRACKET:
+			{
+				int body = newLabel( &encoder );
+				int end = newLabel( &encoder );
+				bracketStack[++bracketStackIndex] = body;
+				assert( bracketStackIndex <= MAX_STACK_SIZE );
+
+				addInstruction( &encoder, X86_CMP, cell, zero );
+				addJump( &encoder, COND_E, end );
+				addLabel( &encoder, body );
 			}
-			else if ( code[i].type == OP_OPEN_BRACKET )
+			break;
+		case OP_CLOSE_BRACKET:
 			{
-				codeIndex += sizeof( uint32_t ); //leave space for the address
-				bracketStack[++bracketStackIndex] = codeIndex; //add the jump address to stack
+				int body = bracketStack[bracketStackIndex--];
 
-				assert( bracketStackIndex <= MAX_STACK_SIZE );
+				//A zero right before the bracket means the loop never goes round again, so there
+				//is no back-edge and no fuel to burn.
+				if ( !(i >= 1 && code[i - 1].type == OP_ZERO) )
+				{
+					if ( flags & ASM_FUEL_CHECKS )
+					{
+						//Burn one unit of fuel per back-edge. The limit exit lives in the header,
+						//the encoder hands back where to patch it once the chunk is placed.
+						addInstruction( &encoder, X86_DEC, memoryOperand( REG_R12, 0, 8 ), noOperand() );
+						addExit( &encoder, COND_E );
+					}
+
+					addInstruction( &encoder, X86_CMP, cell, zero );
+					addJump( &encoder, COND_NE, body );
+				}
+
+				addLabel( &encoder, body + 1 );
 			}
-			else
+			break;
+		case OP_SCAN_RIGHT:
+			addRaw( &encoder, s_scanRight, s_scanRightSize );
+			break;
+		case OP_SCAN_LEFT:
+			addRaw( &encoder, s_scanLeft, s_scanLeftSize );
+			break;
+		case OP_SET:
+			addInstruction( &encoder, X86_MOV, target, immediateOperand( value ) );
+			break;
+		case OP_OUTPUT_CONST:
+			addInstruction( &encoder, X86_MOV, registerOperand( REG_RCX, 4 ), immediateOperand( code[i].value ) );
+			addInstruction( &encoder, X86_CALL, registerOperand( REG_RSI, 8 ), noOperand() );
+			break;
+		case OP_LOOP_COUNT:
+			//Only the low byte of any product matters, so the factors can be sign extended bytes.
+			addInstruction( &encoder, X86_MOVZX, count, cell );
+			addImul( &encoder, count, count, (int8_t)value );
+			break;
+		case OP_MUL_ADD:
+			addImul( &encoder, product, count, (int8_t)value );
+			addInstruction( &encoder, X86_ADD, target, productByte );
+			break;
+		case OP_MUL_CELL:
+			addInstruction( &encoder, X86_MOVZX, product, target );
+			addInstruction( &encoder, X86_IMUL, product, count );
+			addImul( &encoder, product, product, (int8_t)value );
+			break;
+		case OP_ADD_PRODUCT:
+			addInstruction( &encoder, X86_ADD, target, productByte );
+			break;
+		case OP_IF_MASK:
+			//0xff when the cell was non-zero.
+			addInstruction( &encoder, X86_CMP, cell, zero );
+			addConditional( &encoder, X86_SETCC, COND_NE, mask, noOperand() );
+			addInstruction( &encoder, X86_NEG, mask, noOperand() );
+			break;
+		case OP_IF_ADD:
+			addInstruction( &encoder, X86_MOV, productByte, mask );
+			addInstruction( &encoder, X86_AND, productByte, immediateOperand( value ) );
+			addInstruction( &encoder, X86_ADD, target, productByte );
+			break;
+		case OP_IF_SET:
+			addInstruction( &encoder, X86_MOVZX, product, target );
+			addInstruction( &encoder, X86_MOV, registerOperand( REG_RDX, 1 ), immediateOperand( value ) );
+			addInstruction( &encoder, X86_TEST, mask, mask );
+			addConditional( &encoder, X86_CMOVCC, COND_NE, product, registerOperand( REG_RDX, 4 ) );
+			addInstruction( &encoder, X86_MOV, target, productByte );
+			break;
+		case OP_VECTOR_SET:
+		case OP_VECTOR_ADD:
 			{
-				//This is not a bracket so we can paste the value in.
-				size_t size = 0;
+				int wide = s_wideVectors && i + 1 < chunk->end && code[i + 1].type == code[i].type
+					&& code[i + 1].value == code[i].value && code[i + 1].offset == code[i].offset + VECTOR_CELLS;
+
+				addInstruction( &encoder, X86_MOV, registerOperand( REG_RAX, 4 ), immediateOperand( value * 0x01010101u ) );
 
-				switch ( code[i].type )
+				if ( wide )
 				{
-				case OP_ADD:
-				case OP_SUB:
+					addRaw( &encoder, op_vectorBroadcastAvx2, sizeof( op_vectorBroadcastAvx2 ) );
+					if ( code[i].type == OP_VECTOR_SET )
 					{
-						uint8_t value = code[i].value % 256;
-						size = sizeof( uint8_t );
-						memcpy_s( machineCode + codeIndex, size, &value, size );
+						addRawMemory( &encoder, op_vectorStoreAvx2, sizeof( op_vectorStoreAvx2 ), code[i].offset );
 					}
-					break;
-				case OP_ADD_PTR:
-				case OP_SUB_PTR:
+					else
 					{
-						size = sizeof( uint32_t );
-						memcpy_s( machineCode + codeIndex, size, &code[i].value, size );
+						addRawMemory( &encoder, op_vectorAddAvx2, sizeof( op_vectorAddAvx2 ), code[i].offset );
+						addRawMemory( &encoder, op_vectorAddStoreAvx2, sizeof( op_vectorAddStoreAvx2 ), code[i].offset );
 					}
-					break;
-				}
+					addRaw( &encoder, op_vzeroupper, sizeof( op_vzeroupper ) );
 
-				codeIndex += size;
+					//The second op is covered.
+					i++;
+				}
+				else
+				{
+					addRaw( &encoder, op_vectorBroadcast, sizeof( op_vectorBroadcast ) );
+					if ( code[i].type == OP_VECTOR_SET )
+					{
+						addRawMemory( &encoder, op_vectorStore, sizeof( op_vectorStore ), code[i].offset );
+					}
+					else
+					{
+						addRawMemory( &encoder, op_vectorLoad, sizeof( op_vectorLoad ), code[i].offset );
+						addRawMemory( &encoder, op_vectorAddStore, sizeof( op_vectorAddStore ), code[i].offset );
+					}
+				}
 			}
+			break;
 		}
 	}
 
-	memcpy_s( machineCode + codeIndex, sizeof( op_footer ), op_footer, sizeof( op_footer ) );
-	codeIndex += sizeof( op_footer );
-
-	*size = codeIndex;
-
 	free( bracketStack );
 
-	return machineCode;
+	optimiseInstructions( &encoder );
+	chunk->machineCode = encodeInstructions( &encoder, &chunk->size, &chunk->limitFixups, &chunk->limitFixupsCount );
+
+	freeEncoder( &encoder );
 }
 
-static size_t getSize( OpType type )
+DWORD WINAPI assembleWorker( LPVOID parameter )
 {
-	
+	chunkQueue_t* queue = parameter;
 
-	return sizeof( uint32_t );
+	LONG index;
+	while ( (index = InterlockedIncrement( &queue->next ) - 1) < queue->count )
+	{
+		assembleChunk( &queue->chunks[index] );
+	}
+
+	return 0;
 }
 
-void setupInstructionSetTable()
+int getWorkerCount()
 {
-	static int s_instructionTableSetup = 0;
+	SYSTEM_INFO systemInfo;
+	GetSystemInfo( &systemInfo );
 
-	if ( s_instructionTableSetup )
+	int workers = systemInfo.dwNumberOfProcessors;
+	if ( workers > MAXIMUM_WAIT_OBJECTS )
 	{
-		return;
+		workers = MAXIMUM_WAIT_OBJECTS;
 	}
+	return workers < 1 ? 1 : workers;
+}
 
-	setInstruction( OP_INC_PTR, op_incRBX, 0 );
-	setInstruction( OP_DEC_PTR, op_decRBX, 0 );
-	setInstruction( OP_ADD_PTR, op_addRBX, 1 );
-	setInstruction( OP_SUB_PTR, op_subRBX, 1 );
-	setInstruction( OP_INC, op_inc, 0 );
-	setInstruction( OP_DEC, op_dec, 0 );
-	setInstruction( OP_ADD, op_add, 1 );
-	setInstruction( OP_SUB, op_sub, 1 );
-	setInstruction( OP_ZERO, op_zero, 0 );
-	setInstruction( OP_OUTPUT_CHAR, op_putChar, 0 );
-	setInstruction( OP_INPUT_CHAR, op_getChar, 0 );
-	setInstruction( OP_OPEN_BRACKET, op_openBracket, 1 );
-	setInstruction( OP_CLOSE_BRACKET, op_closeBracket, 1 );
+void setupInstructionSetTable( CpuLevel level )
+{
+	//SSE2 is part of x86-64, only the width depends on the level.
+	s_wideVectors = level >= CPU_LEVEL_AVX2;
 
-	s_instructionTableSetup = 1;
-}
\ No newline at end of file
+	//Scan loops come in one variant per level.
+	switch ( level )
+	{
+	case CPU_LEVEL_AVX512:
+		setScan( op_scanRightAvx512, op_scanLeftAvx512 );
+		break;
+	case CPU_LEVEL_AVX2:
+		setScan( op_scanRightAvx2, op_scanLeftAvx2 );
+		break;
+	case CPU_LEVEL_SSE2:
+		setScan( op_scanRightSse2, op_scanLeftSse2 );
+		break;
+	default:
+		setScan( op_scanRight, op_scanLeft );
+		break;
+	}
+}
@@ -2,6 +2,15 @@
 #ifndef ASSEMBLE_H
 #define ASSEMBLE_H
 
-extern unsigned char* assemble( const opcode_t* code, int* size );
+typedef enum AssembleFlags
+{
+	ASM_FUEL_CHECKS = 1 << 0 //Decrement a fuel counter on every loop back-edge and exit when it runs out.
+} AssembleFlags;
+
+extern unsigned char* assemble( const opcode_t* code, int* size, int flags );
+
+//Offset into the code of an exit returning RUN_TAPE_OVERFLOW. It restores the registers from
+//rbp, so the tape fault handler can send a faulting program there from anywhere in its body.
+extern int getTapeOverflowExit();
 
 #endif
\ No newline at end of file
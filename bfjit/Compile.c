@@ -1,6 +1,7 @@
 #include "extern_data.h"
 #include "Compile.h"
 #include <memory.h>
+#include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -8,6 +9,13 @@
 #define MAX_TOKENS 1000
 #define MAX_OP_CODES MAX_TOKENS
 
+//Cells a lowered loop may reach, the counter sits in the middle.
+#define LOOP_WINDOW 32
+#define LOOP_COUNTER (LOOP_WINDOW / 2)
+
+//Cells an if may update before branching beats the branchless version.
+#define IF_MAX_UPDATES 4
+
 typedef enum State
 {
 	STATE_MULTI,
@@ -23,9 +31,31 @@ static const char* s_errorString[ERR_NUM_ERRORS] =
 	"(%d): ] but no matching [\n"
 };
 
-static TokType s_sameTypes[TOK_END];
+static TokType s_sameTypes[TOK_END + 1];
+
+//Cell value as a function of the cell values when the loop iteration began, mod 256.
+typedef struct affine_s
+{
+	uint8_t constant;
+	uint8_t coefficients[LOOP_WINDOW];
+} affine_t;
+
+typedef struct opcodeBuffer_s
+{
+	opcode_t* opcodes;
+	int count;
+	int capacity;
+} opcodeBuffer_t;
+
+//What a straight line block does to one cell, offsets are from the pointer at the start of the block.
+typedef struct cellUpdate_s
+{
+	int64_t offset;
+	int sequence; //Order in the block, updates to the same cell apply in this order.
+	int set; //Set to value rather than value added.
+	uint8_t value;
+} cellUpdate_t;
 
-static char* getSourceText( const char* filename, int* size );
 static int addError( error_t* errors, int* errorsIndex, ErrorType type, int lineNumber );
 static int errorIsFatal( ErrorType type );
 static void printErrors( error_t* errors, int errorsIndex );
@@ -35,6 +65,20 @@ static opcode_t* generateCode( token_t* tokens, int* size, error_t* errors, int*
 
 static void addMultiOpcode( opcode_t* opcodes, int* opcodeIndex, int amount, TokType type );
 
+static opcode_t* lowerLoops( opcode_t* code, int* size );
+static void lowerRange( const opcode_t* code, const int* jumps, int begin, int end, opcodeBuffer_t* out );
+static int lowerLoop( const opcode_t* code, const int* jumps, int open, int close, opcodeBuffer_t* out );
+static int lowerIf( const opcode_t* code, const int* jumps, int open, int close, opcodeBuffer_t* out );
+static opcode_t* vectoriseBlocks( opcode_t* code, int* size );
+static void vectoriseBlock( const opcode_t* code, int begin, int end, opcodeBuffer_t* out );
+static int blockOpcode( OpType type );
+static int compareUpdates( const void* a, const void* b );
+static void pushMove( opcodeBuffer_t* out, int64_t move );
+static int simulateBody( const opcode_t* code, const int* jumps, int begin, int end, affine_t* cells, int* pointer, int nested );
+static void addScaled( affine_t* target, const affine_t* source, uint8_t factor );
+static uint8_t inverse( uint8_t value );
+static void pushOpcode( opcodeBuffer_t* out, OpType type, uint32_t value, int32_t offset );
+
 static int multiplicable( TokType token );
 static int positive( TokType token );
 static int sameType( TokType token1, TokType token2 );
@@ -46,31 +90,47 @@ opcode_t* compile( const char* filename )
 {
 	opcode_t* opcodes = NULL;
 
-	int errorsIndex = 0;
-	error_t* errors = malloc( sizeof( error_t ) * NUMBER_OF_ERRORS_FATAL );
-	int fatalError = 0;
-
 	int size;
 	char* text = getSourceText( filename, &size );
 	if ( text )
 	{
-		token_t* tokens = tokenise( text, &size );
+		opcodes = compileSource( text );
 		free( text );
-		opcodes = generateCode( tokens, &size, errors, &errorsIndex, &fatalError );
-		free( tokens );
 	}
 	else
 	{
-		fatalError |= addError( errors, &errorsIndex, ERR_NO_SOURCE, 0 );
+		error_t error;
+		error.type = ERR_NO_SOURCE;
+		error.lineNumber = 0;
+		printErrors( &error, 1 );
 	}
 
+	return opcodes;
+}
+
+opcode_t* compileSource( const char* text )
+{
+	int errorsIndex = 0;
+	error_t* errors = malloc( sizeof( error_t ) * NUMBER_OF_ERRORS_FATAL );
+	int fatalError = 0;
+
+	int size = (int)strlen( text );
+	token_t* tokens = tokenise( text, &size );
+	opcode_t* opcodes = generateCode( tokens, &size, errors, &errorsIndex, &fatalError );
+	free( tokens );
+
 	if ( errorsIndex )
 	{
 		free( opcodes );
+		opcodes = NULL;
 		printErrors( errors, errorsIndex );
 	}
+	else
+	{
+		opcodes = lowerLoops( opcodes, &size );
+		opcodes = vectoriseBlocks( opcodes, &size );
+	}
 
-	
 	free( errors );
 
 	return opcodes;
@@ -155,6 +215,7 @@ opcode_t* generateCode( token_t* tokens, int* size, error_t* errors, int* errors
 	int index = 0; //Index of the tokens
 
 	int bracketIndex = 0;
+	int skipDepth = 0; //Depth inside a loop we are skipping.
 	token_t* bracketStack = malloc( sizeof( token_t ) * MAX_STACK_SIZE );
 
 	int multiTokCount; //Count of multiplicable tokens we have so far.
@@ -164,7 +225,7 @@ opcode_t* generateCode( token_t* tokens, int* size, error_t* errors, int* errors
 
 	int opcodesIndex = 0;
 	//Size + 1 to include end op code.
-	opcode_t* opcodes = malloc(((*size) + 1) * sizeof(opcode_t));
+	opcode_t* opcodes = calloc( (*size) + 1, sizeof( opcode_t ) );
 
 	while ( ! (*fatalError) && state != STATE_END )
 	{
@@ -207,6 +268,14 @@ opcode_t* generateCode( token_t* tokens, int* size, error_t* errors, int* errors
 					opcodes[opcodesIndex++].type = OP_ZERO;
 					index += 3;
 				}
+				else if ( index+2 < (*size - 1) &&
+					(tokens[index+1].type == TOK_RIGHT_PTR || tokens[index + 1].type == TOK_LEFT_PTR) &&
+					tokens[index+2].type == TOK_CLOSE_BRACKET)
+				{
+					//Scan for the next zero cell, the assembler picks the widest variant the CPU has.
+					opcodes[opcodesIndex++].type = tokens[index+1].type == TOK_RIGHT_PTR ? OP_SCAN_RIGHT : OP_SCAN_LEFT;
+					index += 3;
+				}
 				else
 				{
 					bracketStack[++bracketIndex] = tokens[index];
@@ -234,17 +303,22 @@ opcode_t* generateCode( token_t* tokens, int* size, error_t* errors, int* errors
 			}
 			else if ( tokens[index].type == TOK_INPUT_CHAR )
 			{
+				codeStarted = 1; //Input can make the cell non-zero.
 				opcodes[opcodesIndex++].type = OP_INPUT_CHAR;
 				index++;
 			}
 			break;
 		case STATE_SKIP_BRACKET:
-			if ( tokens[index].type == TOK_CLOSE_BRACKET )
+			if ( tokens[index].type == TOK_OPEN_BRACKET )
+			{
+				skipDepth++;
+			}
+			else if ( tokens[index].type == TOK_CLOSE_BRACKET && --skipDepth == 0 )
 			{
 				state = STATE_SCAN;
 			}
 			index++;
-			if ( index >= (*size - 1) )
+			if ( state == STATE_SKIP_BRACKET && index >= (*size - 1) )
 			{
 				*fatalError |= addError( errors, errorsIndex, ERR_MISSING_CLOSE, tokens[--index].lineNumber );
 				state = STATE_END;
@@ -353,6 +427,674 @@ void addMultiOpcode( opcode_t* opcodes, int* opcodeIndex, int amount, TokType ty
 	}
 }
 
+opcode_t* lowerLoops( opcode_t* code, int* size )
+{
+	int opcodesCount = *size - 1; //Without the end op code.
+
+	int* jumps = malloc( (opcodesCount + 1) * sizeof( int ) );
+	int* bracketStack = malloc( MAX_STACK_SIZE * sizeof( int ) );
+	int bracketStackIndex = 0;
+	for ( int i = 0; i < opcodesCount; i++ )
+	{
+		if ( code[i].type == OP_OPEN_BRACKET )
+		{
+			bracketStack[bracketStackIndex++] = i;
+		}
+		else if ( code[i].type == OP_CLOSE_BRACKET )
+		{
+			jumps[bracketStack[--bracketStackIndex]] = i;
+		}
+	}
+	free( bracketStack );
+
+	opcodeBuffer_t out;
+	out.capacity = *size + 16;
+	out.opcodes = malloc( out.capacity * sizeof( opcode_t ) );
+	out.count = 0;
+
+	lowerRange( code, jumps, 0, opcodesCount, &out );
+	pushOpcode( &out, OP_CODE_END, 0, 0 );
+
+	free( jumps );
+	free( code );
+
+	*size = out.count;
+	return out.opcodes;
+}
+
+void lowerRange( const opcode_t* code, const int* jumps, int begin, int end, opcodeBuffer_t* out )
+{
+	for ( int i = begin; i < end; i++ )
+	{
+		if ( code[i].type != OP_OPEN_BRACKET )
+		{
+			pushOpcode( out, code[i].type, code[i].value, code[i].offset );
+			continue;
+		}
+
+		int close = jumps[i];
+		if ( ! lowerLoop( code, jumps, i, close, out ) && ! lowerIf( code, jumps, i, close, out ) )
+		{
+			//Keep the loop, loops inside it may still lower.
+			pushOpcode( out, OP_OPEN_BRACKET, 0, 0 );
+			lowerRange( code, jumps, i + 1, close, out );
+			pushOpcode( out, OP_CLOSE_BRACKET, 0, 0 );
+		}
+		i = close;
+	}
+}
+
+int lowerLoop( const opcode_t* code, const int* jumps, int open, int close, opcodeBuffer_t* out )
+{
+	//One iteration worked out symbolically, every cell as an affine function of the cells
+	//at the start of the iteration.
+	affine_t cells[LOOP_WINDOW];
+	memset( cells, 0, sizeof( cells ) );
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		cells[i].coefficients[i] = 1;
+	}
+
+	int pointer = LOOP_COUNTER;
+	if ( ! simulateBody( code, jumps, open + 1, close, cells, &pointer, 1 ) || pointer != LOOP_COUNTER )
+	{
+		return 0;
+	}
+
+	//The counter has to step by an odd amount, then it hits zero after exactly
+	//counter * inverse(-step) iterations whatever the start value.
+	affine_t* counter = &cells[LOOP_COUNTER];
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		if ( counter->coefficients[i] != (i == LOOP_COUNTER) )
+		{
+			return 0;
+		}
+	}
+	if ( (counter->constant & 1) == 0 )
+	{
+		return 0;
+	}
+
+	//Cells the body sets to a constant hold it after the first iteration, peeling that
+	//iteration off leaves every later one with the same constants.
+	int peel = 0;
+	int constant[LOOP_WINDOW];
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		int identity = cells[i].constant == 0;
+		int constantRow = i != LOOP_COUNTER;
+		for ( int j = 0; j < LOOP_WINDOW; j++ )
+		{
+			identity &= cells[i].coefficients[j] == (i == j);
+			constantRow &= cells[i].coefficients[j] == 0;
+		}
+
+		constant[i] = constantRow;
+		peel |= constantRow && ! identity;
+	}
+
+	//Later iterations see those constants instead of whatever the cells started with.
+	affine_t increments[LOOP_WINDOW];
+	int invariant[LOOP_WINDOW];
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		memset( &increments[i], 0, sizeof( affine_t ) );
+		increments[i].constant = cells[i].constant;
+		for ( int j = 0; j < LOOP_WINDOW; j++ )
+		{
+			if ( constant[j] )
+				increments[i].constant += cells[i].coefficients[j] * cells[j].constant;
+			else if ( j != i )
+				increments[i].coefficients[j] = cells[i].coefficients[j];
+		}
+
+		invariant[i] = i != LOOP_COUNTER && (constant[i] || (cells[i].coefficients[i] == 1 && increments[i].constant == 0));
+		for ( int j = 0; j < LOOP_WINDOW && invariant[i] && ! constant[i]; j++ )
+		{
+			invariant[i] = increments[i].coefficients[j] == 0;
+		}
+	}
+
+	//Every other cell has to grow by the same amount each iteration: itself plus
+	//something built from cells the loop no longer changes.
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		if ( i == LOOP_COUNTER || invariant[i] )
+		{
+			memset( &increments[i], 0, sizeof( affine_t ) );
+			continue;
+		}
+
+		if ( cells[i].coefficients[i] != 1 )
+		{
+			return 0;
+		}
+
+		for ( int j = 0; j < LOOP_WINDOW; j++ )
+		{
+			if ( increments[i].coefficients[j] && ! invariant[j] )
+			{
+				return 0;
+			}
+		}
+	}
+
+	if ( peel )
+	{
+		//The first iteration runs as it is, guarded by the usual bracket.
+		pushOpcode( out, OP_OPEN_BRACKET, 0, 0 );
+		lowerRange( code, jumps, open + 1, close, out );
+	}
+
+	int counted = 0;
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		int32_t offset = i - LOOP_COUNTER;
+		for ( int j = 0; j < LOOP_WINDOW; j++ )
+		{
+			if ( increments[i].coefficients[j] == 0 && (j != i || increments[i].constant == 0) )
+			{
+				continue;
+			}
+
+			if ( ! counted )
+			{
+				pushOpcode( out, OP_LOOP_COUNT, inverse( (uint8_t)-counter->constant ), 0 );
+				counted = 1;
+			}
+
+			if ( j == i )
+			{
+				//The constant part of the increment.
+				pushOpcode( out, OP_MUL_ADD, increments[i].constant, offset );
+			}
+			else
+			{
+				pushOpcode( out, OP_MUL_CELL, increments[i].coefficients[j], j - LOOP_COUNTER );
+				pushOpcode( out, OP_ADD_PRODUCT, 0, offset );
+			}
+		}
+	}
+
+	pushOpcode( out, OP_ZERO, 0, 0 );
+
+	if ( peel )
+	{
+		pushOpcode( out, OP_CLOSE_BRACKET, 0, 0 );
+	}
+
+	return 1;
+}
+
+int lowerIf( const opcode_t* code, const int* jumps, int open, int close, opcodeBuffer_t* out )
+{
+	affine_t cells[LOOP_WINDOW];
+	memset( cells, 0, sizeof( cells ) );
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		cells[i].coefficients[i] = 1;
+	}
+
+	//No inner loops, every cell then either gains a constant or is set to one.
+	int pointer = LOOP_COUNTER;
+	if ( ! simulateBody( code, jumps, open + 1, close, cells, &pointer, 0 ) || pointer != LOOP_COUNTER )
+	{
+		return 0;
+	}
+
+	//A body that always leaves the condition cell zero runs at most once.
+	affine_t* condition = &cells[LOOP_COUNTER];
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		if ( condition->coefficients[i] )
+		{
+			return 0;
+		}
+	}
+	if ( condition->constant )
+	{
+		return 0;
+	}
+
+	int updates = 0;
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		updates += i != LOOP_COUNTER && (cells[i].coefficients[i] == 0 || cells[i].constant);
+	}
+	if ( updates > IF_MAX_UPDATES )
+	{
+		//Too many to select, branch over the body once instead. The zero right before the bracket
+		//tells the assembler there is no back-edge and no fuel check.
+		pushOpcode( out, OP_OPEN_BRACKET, 0, 0 );
+		lowerRange( code, jumps, open + 1, close, out );
+		if ( out->opcodes[out->count - 1].type != OP_ZERO )
+		{
+			pushOpcode( out, OP_ZERO, 0, 0 );
+		}
+		pushOpcode( out, OP_CLOSE_BRACKET, 0, 0 );
+		return 1;
+	}
+
+	//Data dependent branches mispredict, select the results with the condition as a mask instead.
+	if ( updates )
+	{
+		pushOpcode( out, OP_IF_MASK, 0, 0 );
+	}
+
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		if ( i == LOOP_COUNTER )
+		{
+			continue;
+		}
+
+		if ( cells[i].coefficients[i] == 0 )
+		{
+			pushOpcode( out, OP_IF_SET, cells[i].constant, i - LOOP_COUNTER );
+		}
+		else if ( cells[i].constant )
+		{
+			pushOpcode( out, OP_IF_ADD, cells[i].constant, i - LOOP_COUNTER );
+		}
+	}
+
+	//Zero either way, it only got past the bracket when it was not.
+	pushOpcode( out, OP_ZERO, 0, 0 );
+
+	return 1;
+}
+
+int simulateBody( const opcode_t* code, const int* jumps, int begin, int end, affine_t* cells, int* pointer, int nested )
+{
+	for ( int i = begin; i < end; i++ )
+	{
+		int32_t move = 0;
+		switch ( code[i].type )
+		{
+		case OP_INC_PTR:
+			move = 1;
+			break;
+		case OP_DEC_PTR:
+			move = -1;
+			break;
+		case OP_ADD_PTR:
+			move = code[i].value;
+			break;
+		case OP_SUB_PTR:
+			move = -(int32_t)code[i].value;
+			break;
+		case OP_INC:
+			cells[*pointer].constant++;
+			break;
+		case OP_DEC:
+			cells[*pointer].constant--;
+			break;
+		case OP_ADD:
+			cells[*pointer].constant += (uint8_t)code[i].value;
+			break;
+		case OP_SUB:
+			cells[*pointer].constant -= (uint8_t)code[i].value;
+			break;
+		case OP_ZERO:
+			memset( &cells[*pointer], 0, sizeof( affine_t ) );
+			break;
+		case OP_OPEN_BRACKET:
+			{
+				//An inner loop has to be a plain counted loop of constant adds, its trip count
+				//is then an affine function of the outer cells too.
+				int close = jumps[i];
+				affine_t inner[LOOP_WINDOW];
+				memset( inner, 0, sizeof( inner ) );
+				for ( int j = 0; j < LOOP_WINDOW; j++ )
+				{
+					inner[j].coefficients[j] = 1;
+				}
+
+				int innerPointer = *pointer;
+				if ( ! nested || ! simulateBody( code, jumps, i + 1, close, inner, &innerPointer, 0 ) || innerPointer != *pointer )
+				{
+					return 0;
+				}
+
+				for ( int j = 0; j < LOOP_WINDOW; j++ )
+				{
+					for ( int k = 0; k < LOOP_WINDOW; k++ )
+					{
+						if ( inner[j].coefficients[k] != (j == k) )
+						{
+							return 0;
+						}
+					}
+				}
+
+				uint8_t step = inner[*pointer].constant;
+				if ( (step & 1) == 0 )
+				{
+					return 0;
+				}
+
+				affine_t trips;
+				memset( &trips, 0, sizeof( affine_t ) );
+				addScaled( &trips, &cells[*pointer], inverse( (uint8_t)-step ) );
+				for ( int j = 0; j < LOOP_WINDOW; j++ )
+				{
+					if ( j != *pointer && inner[j].constant )
+					{
+						addScaled( &cells[j], &trips, inner[j].constant );
+					}
+				}
+				memset( &cells[*pointer], 0, sizeof( affine_t ) );
+
+				i = close;
+			}
+			break;
+		default:
+			//Input, output and scans can't be summed up.
+			return 0;
+		}
+
+		if ( move )
+		{
+			int64_t moved = (int64_t)*pointer + move;
+			if ( moved < 0 || moved >= LOOP_WINDOW )
+			{
+				return 0;
+			}
+			*pointer = (int)moved;
+		}
+	}
+
+	return 1;
+}
+
+opcode_t* vectoriseBlocks( opcode_t* code, int* size )
+{
+	int opcodesCount = *size - 1; //Without the end op code.
+
+	opcodeBuffer_t out;
+	out.capacity = *size + 16;
+	out.opcodes = malloc( out.capacity * sizeof( opcode_t ) );
+	out.count = 0;
+
+	for ( int i = 0; i < opcodesCount; )
+	{
+		if ( ! blockOpcode( code[i].type ) )
+		{
+			pushOpcode( &out, code[i].type, code[i].value, code[i].offset );
+			i++;
+			continue;
+		}
+
+		int end = i;
+		while ( end < opcodesCount && blockOpcode( code[end].type ) )
+		{
+			end++;
+		}
+
+		vectoriseBlock( code, i, end, &out );
+		i = end;
+	}
+	pushOpcode( &out, OP_CODE_END, 0, 0 );
+
+	free( code );
+
+	*size = out.count;
+	return out.opcodes;
+}
+
+void vectoriseBlock( const opcode_t* code, int begin, int end, opcodeBuffer_t* out )
+{
+	//Every cell update in the block, then sorted into runs over neighbouring cells.
+	cellUpdate_t* updates = malloc( (end - begin) * sizeof( cellUpdate_t ) );
+	int updatesCount = 0;
+	int64_t pointer = 0;
+	for ( int i = begin; i < end; i++ )
+	{
+		cellUpdate_t* update = &updates[updatesCount];
+		update->offset = pointer;
+		update->sequence = i;
+		update->set = 0;
+
+		switch ( code[i].type )
+		{
+		case OP_INC_PTR:
+			pointer++;
+			continue;
+		case OP_DEC_PTR:
+			pointer--;
+			continue;
+		case OP_ADD_PTR:
+			pointer += code[i].value;
+			continue;
+		case OP_SUB_PTR:
+			pointer -= code[i].value;
+			continue;
+		case OP_INC:
+			update->value = 1;
+			break;
+		case OP_DEC:
+			update->value = 0xff;
+			break;
+		case OP_ADD:
+			update->value = (uint8_t)code[i].value;
+			break;
+		case OP_SUB:
+			update->value = (uint8_t)-(int32_t)code[i].value;
+			break;
+		case OP_ZERO:
+			update->set = 1;
+			update->value = 0;
+			break;
+		case OP_SET:
+			update->set = 1;
+			update->value = (uint8_t)code[i].value;
+			update->offset += code[i].offset;
+			break;
+		}
+		updatesCount++;
+	}
+
+	qsort( updates, updatesCount, sizeof( cellUpdate_t ), compareUpdates );
+
+	//Fold each cell's updates into one.
+	int cellsCount = 0;
+	for ( int i = 0; i < updatesCount; i++ )
+	{
+		if ( cellsCount && updates[cellsCount - 1].offset == updates[i].offset )
+		{
+			cellUpdate_t* cell = &updates[cellsCount - 1];
+			if ( updates[i].set )
+				cell->value = updates[i].value;
+			else
+				cell->value += updates[i].value;
+			cell->set |= updates[i].set;
+		}
+		else
+		{
+			updates[cellsCount++] = updates[i];
+		}
+	}
+
+	//Runs of cells that are all set to, or all gain, the same value. Sets may overlap
+	//their last vector with the one before, adds leave the remainder to the scalar ops.
+	int* vectors = malloc( (cellsCount / VECTOR_CELLS + 1) * 2 * sizeof( int ) );
+	int vectorsCount = 0;
+	int64_t* covered = malloc( (cellsCount / VECTOR_CELLS + 1) * 2 * sizeof( int64_t ) );
+	int coveredCount = 0;
+	for ( int i = 0; i < cellsCount; )
+	{
+		int run = i + 1;
+		while ( run < cellsCount && updates[run].offset == updates[run - 1].offset + 1
+			&& updates[run].set == updates[i].set && updates[run].value == updates[i].value )
+		{
+			run++;
+		}
+
+		int length = run - i;
+		int64_t first = updates[i].offset;
+		int usable = updates[i].set || updates[i].value;
+		if ( usable && length >= VECTOR_CELLS && first >= INT32_MIN && first + length <= INT32_MAX )
+		{
+			int vectorCells = updates[i].set ? length : length - length % VECTOR_CELLS;
+			for ( int j = 0; j + VECTOR_CELLS <= vectorCells; j += VECTOR_CELLS )
+			{
+				vectors[vectorsCount++] = i + j;
+			}
+			if ( vectorCells % VECTOR_CELLS )
+			{
+				vectors[vectorsCount++] = i + vectorCells - VECTOR_CELLS;
+			}
+
+			covered[coveredCount++] = first;
+			covered[coveredCount++] = first + vectorCells;
+		}
+
+		i = run;
+	}
+
+	if ( vectorsCount == 0 )
+	{
+		for ( int i = begin; i < end; i++ )
+		{
+			pushOpcode( out, code[i].type, code[i].value, code[i].offset );
+		}
+	}
+	else
+	{
+		//The rest of the block as it was, minus the covered cells, with the pointer
+		//moves in between gathered up.
+		int64_t position = 0;
+		pointer = 0;
+		for ( int i = begin; i < end; i++ )
+		{
+			int64_t target = pointer;
+			switch ( code[i].type )
+			{
+			case OP_INC_PTR:
+				pointer++;
+				continue;
+			case OP_DEC_PTR:
+				pointer--;
+				continue;
+			case OP_ADD_PTR:
+				pointer += code[i].value;
+				continue;
+			case OP_SUB_PTR:
+				pointer -= code[i].value;
+				continue;
+			case OP_SET:
+				target += code[i].offset;
+				break;
+			}
+
+			int skip = 0;
+			for ( int j = 0; j < coveredCount && ! skip; j += 2 )
+			{
+				skip = target >= covered[j] && target < covered[j + 1];
+			}
+			if ( skip )
+			{
+				continue;
+			}
+
+			pushMove( out, pointer - position );
+			position = pointer;
+			pushOpcode( out, code[i].type, code[i].value, code[i].offset );
+		}
+
+		for ( int i = 0; i < vectorsCount; i++ )
+		{
+			cellUpdate_t* cell = &updates[vectors[i]];
+			pushOpcode( out, cell->set ? OP_VECTOR_SET : OP_VECTOR_ADD, cell->value, (int32_t)(cell->offset - position) );
+		}
+
+		pushMove( out, pointer - position );
+	}
+
+	free( covered );
+	free( vectors );
+	free( updates );
+}
+
+int blockOpcode( OpType type )
+{
+	//Ops that only move the pointer or change the cells by constants.
+	switch ( type )
+	{
+	case OP_INC_PTR:
+	case OP_DEC_PTR:
+	case OP_ADD_PTR:
+	case OP_SUB_PTR:
+	case OP_INC:
+	case OP_DEC:
+	case OP_ADD:
+	case OP_SUB:
+	case OP_ZERO:
+	case OP_SET:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int compareUpdates( const void* a, const void* b )
+{
+	const cellUpdate_t* first = a;
+	const cellUpdate_t* second = b;
+
+	if ( first->offset != second->offset )
+		return first->offset < second->offset ? -1 : 1;
+
+	return first->sequence - second->sequence;
+}
+
+void pushMove( opcodeBuffer_t* out, int64_t move )
+{
+	if ( move == 1 )
+		pushOpcode( out, OP_INC_PTR, 0, 0 );
+	else if ( move == -1 )
+		pushOpcode( out, OP_DEC_PTR, 0, 0 );
+	else if ( move > 0 )
+		pushOpcode( out, OP_ADD_PTR, (uint32_t)move, 0 );
+	else if ( move < 0 )
+		pushOpcode( out, OP_SUB_PTR, (uint32_t)-move, 0 );
+}
+
+void addScaled( affine_t* target, const affine_t* source, uint8_t factor )
+{
+	target->constant += source->constant * factor;
+	for ( int i = 0; i < LOOP_WINDOW; i++ )
+	{
+		target->coefficients[i] += source->coefficients[i] * factor;
+	}
+}
+
+uint8_t inverse( uint8_t value )
+{
+	//Odd numbers are units mod 256, Newton's iteration doubles the correct bits each step.
+	uint8_t result = value;
+	for ( int i = 0; i < 3; i++ )
+	{
+		result *= 2 - value * result;
+	}
+	return result;
+}
+
+void pushOpcode( opcodeBuffer_t* out, OpType type, uint32_t value, int32_t offset )
+{
+	if ( out->count == out->capacity )
+	{
+		out->capacity *= 2;
+		out->opcodes = realloc( out->opcodes, out->capacity * sizeof( opcode_t ) );
+	}
+
+	out->opcodes[out->count].type = type;
+	out->opcodes[out->count].value = value;
+	out->opcodes[out->count].offset = offset;
+	out->count++;
+}
+
 char* getSourceText( const char* filename, int* fileLength )
 {
 	char* text = NULL;
@@ -3,5 +3,7 @@
 #define COMPILE_H
 
 extern opcode_t* compile( const char* filename );
+extern opcode_t* compileSource( const char* text );
+extern char* getSourceText( const char* filename, int* size );
 
 #endif
\ No newline at end of file
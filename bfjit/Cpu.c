@@ -0,0 +1,142 @@
+#include "extern_data.h"
+#include "Cpu.h"
+#include <stdio.h>
+#include <string.h>
+#include <intrin.h>
+
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+#define XCR0_AVX512 (7 << 5) //Opmask, upper halves of zmm0-15 and zmm16-31.
+
+static const char* s_levelNames[CPU_LEVEL_COUNT] = { "scalar", "sse2", "avx2", "avx512" };
+
+static int s_features = -1;
+static int s_level = -1;
+
+static int detectCpuFeatures();
+
+int getCpuFeatures()
+{
+	if ( s_features < 0 )
+	{
+		s_features = detectCpuFeatures();
+	}
+	return s_features;
+}
+
+CpuLevel getSupportedCpuLevel()
+{
+	int features = getCpuFeatures();
+
+	if ( features & CPU_AVX512BW )
+		return CPU_LEVEL_AVX512;
+	if ( features & CPU_AVX2 )
+		return CPU_LEVEL_AVX2;
+	return CPU_LEVEL_SSE2;
+}
+
+CpuLevel getCpuLevel()
+{
+	if ( s_level < 0 )
+	{
+		s_level = getSupportedCpuLevel();
+	}
+	return s_level;
+}
+
+int setCpuLevel( CpuLevel level )
+{
+	//Only ever go down, code for a level the CPU lacks would fault on the first vector op.
+	if ( level > getSupportedCpuLevel() )
+	{
+		return 0;
+	}
+
+	s_level = level;
+	return 1;
+}
+
+const char* getCpuLevelName( CpuLevel level )
+{
+	return s_levelNames[level];
+}
+
+int parseCpuLevel( const char* name, CpuLevel* level )
+{
+	for ( int i = 0; i < CPU_LEVEL_COUNT; i++ )
+	{
+		if ( strcmp( name, s_levelNames[i] ) == 0 )
+		{
+			*level = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void printCpuInfo()
+{
+	int features = getCpuFeatures();
+
+	printf( "SSE4.2: %s\n", (features & CPU_SSE42) ? "yes" : "no" );
+	printf( "AVX2: %s\n", (features & CPU_AVX2) ? "yes" : "no" );
+	printf( "AVX-512BW: %s\n", (features & CPU_AVX512BW) ? "yes" : "no" );
+	printf( "BMI2: %s\n", (features & CPU_BMI2) ? "yes" : "no" );
+	printf( "ERMS: %s\n", (features & CPU_ERMS) ? "yes" : "no" );
+	printf( "FSRM: %s\n", (features & CPU_FSRM) ? "yes" : "no" );
+	printf( "Supported level: %s\n", getCpuLevelName( getSupportedCpuLevel() ) );
+	printf( "Code generation level: %s\n", getCpuLevelName( getCpuLevel() ) );
+}
+
+int detectCpuFeatures()
+{
+	int registers[4]; //eax, ebx, ecx, edx
+	int features = 0;
+
+	__cpuid( registers, 0 );
+	int maxLeaf = registers[0];
+
+	__cpuid( registers, 1 );
+	if ( registers[2] & (1 << 20) )
+	{
+		features |= CPU_SSE42;
+	}
+	int avx = registers[2] & (1 << 28);
+
+	//The CPU having AVX is not enough, the OS has to save the wider registers too.
+	unsigned long long xcr0 = 0;
+	if ( registers[2] & (1 << 27) ) //OSXSAVE
+	{
+		xcr0 = _xgetbv( 0 );
+	}
+	int avxState = (xcr0 & (XCR0_SSE | XCR0_AVX)) == (XCR0_SSE | XCR0_AVX);
+	int avx512State = avxState && (xcr0 & XCR0_AVX512) == XCR0_AVX512;
+
+	if ( maxLeaf >= 7 )
+	{
+		__cpuidex( registers, 7, 0 );
+
+		if ( (registers[1] & (1 << 5)) && avx && avxState )
+		{
+			features |= CPU_AVX2;
+		}
+		if ( (registers[1] & (1 << 30)) && (registers[1] & (1 << 16)) && avx512State ) //AVX-512BW and F
+		{
+			features |= CPU_AVX512BW;
+		}
+		if ( registers[1] & (1 << 8) )
+		{
+			features |= CPU_BMI2;
+		}
+		if ( registers[1] & (1 << 9) )
+		{
+			features |= CPU_ERMS;
+		}
+		if ( registers[3] & (1 << 4) )
+		{
+			features |= CPU_FSRM;
+		}
+	}
+
+	return features;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#ifndef CPU_H
+#define CPU_H
+
+//Code generation levels, each one picks the widest emitter variants the level allows.
+typedef enum CpuLevel
+{
+	CPU_LEVEL_SCALAR, //Baseline x86-64, byte at a time.
+	CPU_LEVEL_SSE2, //16 byte vectors, part of x86-64 so always there.
+	CPU_LEVEL_AVX2, //32 byte vectors.
+	CPU_LEVEL_AVX512, //64 byte vectors and mask registers (AVX-512BW).
+	CPU_LEVEL_COUNT
+} CpuLevel;
+
+typedef enum CpuFeatures
+{
+	CPU_SSE42 = 1 << 0,
+	CPU_AVX2 = 1 << 1,
+	CPU_AVX512BW = 1 << 2,
+	CPU_BMI2 = 1 << 3,
+	CPU_ERMS = 1 << 4, //Enhanced rep movsb/stosb.
+	CPU_FSRM = 1 << 5 //Fast short rep movsb.
+} CpuFeatures;
+
+extern int getCpuFeatures();
+extern CpuLevel getSupportedCpuLevel();
+
+//Level the assembler emits for, the highest supported one unless forced lower.
+extern CpuLevel getCpuLevel();
+extern int setCpuLevel( CpuLevel level );
+
+extern const char* getCpuLevelName( CpuLevel level );
+extern int parseCpuLevel( const char* name, CpuLevel* level );
+extern void printCpuInfo();
+
+#endif
@@ -0,0 +1,614 @@
+#include "extern_data.h"
+#include "Encode.h"
+#include <memory.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Longest instruction the encoder produces, raw code aside.
+#define MAX_INSTRUCTION_SIZE 16
+
+#define REX 0x40
+#define REX_W 0x08
+#define REX_R 0x04
+#define REX_B 0x01
+
+static instruction_t* pushInstruction( encoder_t* encoder, Mnemonic mnemonic );
+static int encodeInstruction( const instruction_t* instruction, int longJump, int32_t jump, unsigned char* out );
+static int encodeOperation( unsigned char* out, int wide, const unsigned char* opcode, int opcodeSize, int reg, const operand_t* rm, const operand_t* other );
+static int encodeModRm( unsigned char* out, int reg, const operand_t* rm );
+static int encodeImmediate( unsigned char* out, int64_t value, int size );
+static int fitsByte( int64_t value );
+
+static int pointerMove( const instruction_t* instruction, int64_t* amount );
+static int usesPointerRegister( const instruction_t* instruction );
+static int readsFlags( const instruction_t* instruction );
+static int crossable( const instruction_t* instruction, const instruction_t* next, int64_t amount );
+static void addPointerMove( encoder_t* encoder, int64_t amount );
+static int sameOperand( const operand_t* first, const operand_t* second );
+
+operand_t registerOperand( Register base, int size )
+{
+	operand_t operand = noOperand();
+	operand.kind = OPERAND_REGISTER;
+	operand.size = size;
+	operand.base = base;
+	return operand;
+}
+
+operand_t memoryOperand( Register base, int32_t displacement, int size )
+{
+	operand_t operand = noOperand();
+	operand.kind = OPERAND_MEMORY;
+	operand.size = size;
+	operand.base = base;
+	operand.displacement = displacement;
+	return operand;
+}
+
+operand_t immediateOperand( int64_t value )
+{
+	operand_t operand = noOperand();
+	operand.kind = OPERAND_IMMEDIATE;
+	operand.immediate = value;
+	return operand;
+}
+
+operand_t noOperand()
+{
+	operand_t operand;
+	memset( &operand, 0, sizeof( operand ) );
+	operand.kind = OPERAND_NONE;
+	return operand;
+}
+
+void initEncoder( encoder_t* encoder )
+{
+	encoder->capacity = 256;
+	encoder->instructions = malloc( encoder->capacity * sizeof( instruction_t ) );
+	encoder->count = 0;
+	encoder->labels = 0;
+}
+
+void freeEncoder( encoder_t* encoder )
+{
+	free( encoder->instructions );
+	encoder->instructions = NULL;
+	encoder->count = 0;
+	encoder->capacity = 0;
+}
+
+int newLabel( encoder_t* encoder )
+{
+	return encoder->labels++;
+}
+
+void addLabel( encoder_t* encoder, int label )
+{
+	pushInstruction( encoder, X86_LABEL )->label = label;
+}
+
+void addInstruction( encoder_t* encoder, Mnemonic mnemonic, operand_t destination, operand_t source )
+{
+	instruction_t* instruction = pushInstruction( encoder, mnemonic );
+	instruction->destination = destination;
+	instruction->source = source;
+}
+
+void addImul( encoder_t* encoder, operand_t destination, operand_t source, int32_t factor )
+{
+	instruction_t* instruction = pushInstruction( encoder, X86_IMUL );
+	instruction->destination = destination;
+	instruction->source = source;
+	instruction->factor = factor;
+	instruction->hasFactor = 1;
+}
+
+void addConditional( encoder_t* encoder, Mnemonic mnemonic, Condition condition, operand_t destination, operand_t source )
+{
+	instruction_t* instruction = pushInstruction( encoder, mnemonic );
+	instruction->condition = condition;
+	instruction->destination = destination;
+	instruction->source = source;
+}
+
+void addJump( encoder_t* encoder, Condition condition, int label )
+{
+	instruction_t* instruction = pushInstruction( encoder, X86_JCC );
+	instruction->condition = condition;
+	instruction->label = label;
+}
+
+void addExit( encoder_t* encoder, Condition condition )
+{
+	addJump( encoder, condition, -1 );
+}
+
+void addRaw( encoder_t* encoder, const unsigned char* bytes, int size )
+{
+	instruction_t* instruction = pushInstruction( encoder, X86_RAW );
+	instruction->raw = bytes;
+	instruction->rawSize = size;
+}
+
+void addRawMemory( encoder_t* encoder, const unsigned char* bytes, int size, int32_t displacement )
+{
+	instruction_t* instruction = pushInstruction( encoder, X86_RAW );
+	instruction->raw = bytes;
+	instruction->rawSize = size;
+	instruction->rawMemory = 1;
+	instruction->destination = memoryOperand( REG_RBX, displacement, 1 );
+}
+
+instruction_t* pushInstruction( encoder_t* encoder, Mnemonic mnemonic )
+{
+	if ( encoder->count == encoder->capacity )
+	{
+		encoder->capacity *= 2;
+		encoder->instructions = realloc( encoder->instructions, encoder->capacity * sizeof( instruction_t ) );
+	}
+
+	instruction_t* instruction = &encoder->instructions[encoder->count++];
+	memset( instruction, 0, sizeof( instruction_t ) );
+	instruction->mnemonic = mnemonic;
+	instruction->destination = noOperand();
+	instruction->source = noOperand();
+	return instruction;
+}
+
+void optimiseInstructions( encoder_t* encoder )
+{
+	instruction_t* instructions = encoder->instructions;
+	int count = encoder->count;
+
+	//Rebuilt in place, the output never gets ahead of the input.
+	encoder->instructions = malloc( encoder->capacity * sizeof( instruction_t ) );
+	encoder->count = 0;
+
+	//Pointer moves are held back while the instructions after them only use the pointer as a
+	//base, those take the move in their displacement instead. Moves in a row add up.
+	int64_t pending = 0;
+	for ( int i = 0; i < count; i++ )
+	{
+		instruction_t instruction = instructions[i];
+		const instruction_t* next = i + 1 < count ? &instructions[i + 1] : NULL;
+
+		int64_t amount;
+		if ( pointerMove( &instruction, &amount ) )
+		{
+			pending += amount;
+			continue;
+		}
+
+		if ( pending && crossable( &instruction, next, pending ) )
+		{
+			if ( instruction.destination.kind == OPERAND_MEMORY && instruction.destination.base == REG_RBX )
+				instruction.destination.displacement += (int32_t)pending;
+			if ( instruction.source.kind == OPERAND_MEMORY && instruction.source.base == REG_RBX )
+				instruction.source.displacement += (int32_t)pending;
+		}
+		else
+		{
+			addPointerMove( encoder, pending );
+			pending = 0;
+		}
+
+		//Multiplying by one is a move, or nothing at all into the same register.
+		if ( instruction.mnemonic == X86_IMUL && instruction.hasFactor && instruction.factor == 1 && instruction.source.kind == OPERAND_REGISTER )
+		{
+			if ( instruction.source.base == instruction.destination.base )
+				continue;
+
+			instruction.mnemonic = X86_MOV;
+			instruction.hasFactor = 0;
+		}
+
+		//A compare against zero straight after an ALU op on the same cell only repeats its ZF.
+		instruction_t* previous = encoder->count ? &encoder->instructions[encoder->count - 1] : NULL;
+		if ( instruction.mnemonic == X86_CMP && instruction.source.kind == OPERAND_IMMEDIATE && instruction.source.immediate == 0
+			&& previous && previous->mnemonic <= X86_NEG && previous->mnemonic != X86_CMP && previous->mnemonic != X86_MOV && previous->mnemonic != X86_MOVZX
+			&& sameOperand( &previous->destination, &instruction.destination )
+			&& next && readsFlags( next ) && (next->condition == COND_E || next->condition == COND_NE) )
+		{
+			continue;
+		}
+
+		encoder->instructions[encoder->count++] = instruction;
+	}
+	addPointerMove( encoder, pending );
+
+	free( instructions );
+}
+
+int pointerMove( const instruction_t* instruction, int64_t* amount )
+{
+	const operand_t* destination = &instruction->destination;
+	if ( destination->kind != OPERAND_REGISTER || destination->base != REG_RBX || destination->size != 8 )
+	{
+		return 0;
+	}
+
+	switch ( instruction->mnemonic )
+	{
+	case X86_INC:
+		*amount = 1;
+		return 1;
+	case X86_DEC:
+		*amount = -1;
+		return 1;
+	case X86_ADD:
+	case X86_SUB:
+		if ( instruction->source.kind != OPERAND_IMMEDIATE )
+			return 0;
+		*amount = instruction->mnemonic == X86_ADD ? instruction->source.immediate : -instruction->source.immediate;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int usesPointerRegister( const instruction_t* instruction )
+{
+	return (instruction->destination.kind == OPERAND_REGISTER && instruction->destination.base == REG_RBX)
+		|| (instruction->source.kind == OPERAND_REGISTER && instruction->source.base == REG_RBX);
+}
+
+int readsFlags( const instruction_t* instruction )
+{
+	return (instruction->mnemonic == X86_JCC && instruction->condition != COND_ALWAYS)
+		|| instruction->mnemonic == X86_SETCC
+		|| instruction->mnemonic == X86_CMOVCC;
+}
+
+int crossable( const instruction_t* instruction, const instruction_t* next, int64_t amount )
+{
+	//Control flow, code we can't see into and anything wanting the pointer itself stop the move.
+	if ( instruction->mnemonic == X86_LABEL || instruction->mnemonic == X86_JCC
+		|| (instruction->mnemonic == X86_RAW && ! instruction->rawMemory) || usesPointerRegister( instruction ) )
+	{
+		return 0;
+	}
+
+	//The move would land between flags and the instruction reading them.
+	if ( next && readsFlags( next ) )
+	{
+		return 0;
+	}
+
+	const operand_t* operands[2] = { &instruction->destination, &instruction->source };
+	for ( int i = 0; i < 2; i++ )
+	{
+		if ( operands[i]->kind == OPERAND_MEMORY && operands[i]->base == REG_RBX )
+		{
+			int64_t displacement = operands[i]->displacement + amount;
+			if ( displacement < INT32_MIN || displacement > INT32_MAX )
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+void addPointerMove( encoder_t* encoder, int64_t amount )
+{
+	operand_t pointer = registerOperand( REG_RBX, 8 );
+
+	//Sums of several moves can outgrow an imm32, split them up.
+	while ( amount )
+	{
+		int64_t step = amount > INT32_MAX ? INT32_MAX : amount < -INT32_MAX ? -INT32_MAX : amount;
+
+		if ( step == 1 )
+			addInstruction( encoder, X86_INC, pointer, noOperand() );
+		else if ( step == -1 )
+			addInstruction( encoder, X86_DEC, pointer, noOperand() );
+		else if ( step > 0 )
+			addInstruction( encoder, X86_ADD, pointer, immediateOperand( step ) );
+		else
+			addInstruction( encoder, X86_SUB, pointer, immediateOperand( -step ) );
+
+		amount -= step;
+	}
+}
+
+int sameOperand( const operand_t* first, const operand_t* second )
+{
+	return first->kind == second->kind && first->size == second->size && first->base == second->base
+		&& (first->kind != OPERAND_MEMORY || first->displacement == second->displacement);
+}
+
+unsigned char* encodeInstructions( encoder_t* encoder, int* size, int** exitFixups, int* exitFixupsCount )
+{
+	const instruction_t* instructions = encoder->instructions;
+	int count = encoder->count;
+
+	int* addresses = malloc( (count + 1) * sizeof( int ) );
+	int* labelAddresses = malloc( (encoder->labels + 1) * sizeof( int ) );
+	char* longJumps = calloc( count + 1, 1 );
+	unsigned char scratch[MAX_INSTRUCTION_SIZE];
+
+	//Exits are patched later, they have to take any offset.
+	int exits = 0;
+	for ( int i = 0; i < count; i++ )
+	{
+		if ( instructions[i].mnemonic == X86_JCC && instructions[i].label < 0 )
+		{
+			longJumps[i] = 1;
+			exits++;
+		}
+	}
+
+	//Every jump starts short and only grows when its target is out of reach, growing only
+	//moves targets further away so this settles.
+	for ( int changed = 1; changed; )
+	{
+		changed = 0;
+
+		int address = 0;
+		for ( int i = 0; i < count; i++ )
+		{
+			addresses[i] = address;
+			if ( instructions[i].mnemonic == X86_LABEL )
+			{
+				labelAddresses[instructions[i].label] = address;
+			}
+			address += instructions[i].mnemonic == X86_RAW ? instructions[i].rawSize + (instructions[i].rawMemory ? 4 : 0)
+				: encodeInstruction( &instructions[i], longJumps[i], 0, scratch );
+		}
+		addresses[count] = address;
+
+		for ( int i = 0; i < count; i++ )
+		{
+			if ( instructions[i].mnemonic == X86_JCC && ! longJumps[i] )
+			{
+				int64_t jump = labelAddresses[instructions[i].label] - addresses[i + 1];
+				if ( ! fitsByte( jump ) )
+				{
+					longJumps[i] = 1;
+					changed = 1;
+				}
+			}
+		}
+	}
+
+	unsigned char* machineCode = malloc( addresses[count] + 1 );
+	*exitFixups = malloc( (exits + 1) * sizeof( int ) );
+	*exitFixupsCount = 0;
+
+	for ( int i = 0; i < count; i++ )
+	{
+		int32_t jump = 0;
+		if ( instructions[i].mnemonic == X86_JCC )
+		{
+			if ( instructions[i].label < 0 )
+				(*exitFixups)[(*exitFixupsCount)++] = addresses[i + 1] - sizeof( int32_t );
+			else
+				jump = labelAddresses[instructions[i].label] - addresses[i + 1];
+		}
+
+		encodeInstruction( &instructions[i], longJumps[i], jump, machineCode + addresses[i] );
+	}
+
+	*size = addresses[count];
+
+	free( addresses );
+	free( labelAddresses );
+	free( longJumps );
+
+	return machineCode;
+}
+
+int encodeInstruction( const instruction_t* instruction, int longJump, int32_t jump, unsigned char* out )
+{
+	const operand_t* destination = &instruction->destination;
+	const operand_t* source = &instruction->source;
+	int wide = destination->size == 8;
+	int size = 0;
+
+	switch ( instruction->mnemonic )
+	{
+	case X86_ADD:
+	case X86_OR:
+	case X86_ADC:
+	case X86_SBB:
+	case X86_AND:
+	case X86_SUB:
+	case X86_XOR:
+	case X86_CMP:
+		{
+			int group = instruction->mnemonic - X86_ADD;
+			if ( source->kind == OPERAND_IMMEDIATE )
+			{
+				//80 for bytes, 83 when the immediate fits a sign extended byte, 81 otherwise.
+				unsigned char opcode = destination->size == 1 ? 0x80 : fitsByte( source->immediate ) ? 0x83 : 0x81;
+				size = encodeOperation( out, wide, &opcode, 1, group, destination, NULL );
+				size += encodeImmediate( out + size, source->immediate, opcode == 0x81 ? 4 : 1 );
+			}
+			else if ( source->kind == OPERAND_REGISTER )
+			{
+				unsigned char opcode = (unsigned char)(group * 8 + (destination->size == 1 ? 0x00 : 0x01));
+				size = encodeOperation( out, wide, &opcode, 1, source->base, destination, source );
+			}
+			else
+			{
+				unsigned char opcode = (unsigned char)(group * 8 + (destination->size == 1 ? 0x02 : 0x03));
+				size = encodeOperation( out, wide, &opcode, 1, destination->base, source, destination );
+			}
+		}
+		break;
+	case X86_MOV:
+		if ( source->kind == OPERAND_IMMEDIATE )
+		{
+			if ( destination->kind == OPERAND_REGISTER && (destination->size != 8 || source->immediate < INT32_MIN || source->immediate > INT32_MAX) )
+			{
+				//b0/b8 + register, the shortest form unless a sign extended imm32 does for 64 bits.
+				int rex = (wide ? REX_W : 0) | (destination->base & 8 ? REX_B : 0);
+				if ( rex || (destination->size == 1 && destination->base >= REG_RSP) )
+					out[size++] = (unsigned char)(REX | rex);
+				out[size++] = (unsigned char)((destination->size == 1 ? 0xb0 : 0xb8) + (destination->base & 7));
+				size += encodeImmediate( out + size, source->immediate, destination->size );
+			}
+			else
+			{
+				unsigned char opcode = destination->size == 1 ? 0xc6 : 0xc7;
+				size = encodeOperation( out, wide, &opcode, 1, 0, destination, NULL );
+				size += encodeImmediate( out + size, source->immediate, destination->size == 1 ? 1 : 4 );
+			}
+		}
+		else if ( source->kind == OPERAND_REGISTER )
+		{
+			unsigned char opcode = destination->size == 1 ? 0x88 : 0x89;
+			size = encodeOperation( out, wide, &opcode, 1, source->base, destination, source );
+		}
+		else
+		{
+			unsigned char opcode = destination->size == 1 ? 0x8a : 0x8b;
+			size = encodeOperation( out, wide, &opcode, 1, destination->base, source, destination );
+		}
+		break;
+	case X86_MOVZX:
+		{
+			static const unsigned char opcode[] = { 0x0f, 0xb6 };
+			size = encodeOperation( out, wide, opcode, sizeof( opcode ), destination->base, source, NULL );
+		}
+		break;
+	case X86_INC:
+	case X86_DEC:
+	case X86_NEG:
+		{
+			unsigned char opcode = instruction->mnemonic == X86_NEG ? (destination->size == 1 ? 0xf6 : 0xf7) : (destination->size == 1 ? 0xfe : 0xff);
+			int digit = instruction->mnemonic == X86_INC ? 0 : instruction->mnemonic == X86_DEC ? 1 : 3;
+			size = encodeOperation( out, wide, &opcode, 1, digit, destination, NULL );
+		}
+		break;
+	case X86_TEST:
+		{
+			unsigned char opcode = destination->size == 1 ? 0x84 : 0x85;
+			size = encodeOperation( out, wide, &opcode, 1, source->base, destination, source );
+		}
+		break;
+	case X86_IMUL:
+		if ( instruction->hasFactor )
+		{
+			unsigned char opcode = fitsByte( instruction->factor ) ? 0x6b : 0x69;
+			size = encodeOperation( out, wide, &opcode, 1, destination->base, source, NULL );
+			size += encodeImmediate( out + size, instruction->factor, opcode == 0x6b ? 1 : 4 );
+		}
+		else
+		{
+			static const unsigned char opcode[] = { 0x0f, 0xaf };
+			size = encodeOperation( out, wide, opcode, sizeof( opcode ), destination->base, source, NULL );
+		}
+		break;
+	case X86_SETCC:
+		{
+			unsigned char opcode[] = { 0x0f, (unsigned char)(0x90 + instruction->condition) };
+			size = encodeOperation( out, 0, opcode, sizeof( opcode ), 0, destination, NULL );
+		}
+		break;
+	case X86_CMOVCC:
+		{
+			unsigned char opcode[] = { 0x0f, (unsigned char)(0x40 + instruction->condition) };
+			size = encodeOperation( out, wide, opcode, sizeof( opcode ), destination->base, source, NULL );
+		}
+		break;
+	case X86_CALL:
+		{
+			//Near calls are 64 bit without REX.W.
+			unsigned char opcode = 0xff;
+			size = encodeOperation( out, 0, &opcode, 1, 2, destination, NULL );
+		}
+		break;
+	case X86_JCC:
+		if ( instruction->condition == COND_ALWAYS )
+		{
+			out[size++] = longJump ? 0xe9 : 0xeb;
+		}
+		else if ( longJump )
+		{
+			out[size++] = 0x0f;
+			out[size++] = (unsigned char)(0x80 + instruction->condition);
+		}
+		else
+		{
+			out[size++] = (unsigned char)(0x70 + instruction->condition);
+		}
+		size += encodeImmediate( out + size, jump, longJump ? 4 : 1 );
+		break;
+	case X86_LABEL:
+		break;
+	case X86_RAW:
+		memcpy_s( out, instruction->rawSize, instruction->raw, instruction->rawSize );
+		size = instruction->rawSize;
+		if ( instruction->rawMemory )
+		{
+			size += encodeImmediate( out + size, destination->displacement, 4 );
+		}
+		break;
+	}
+
+	return size;
+}
+
+int encodeOperation( unsigned char* out, int wide, const unsigned char* opcode, int opcodeSize, int reg, const operand_t* rm, const operand_t* other )
+{
+	int size = 0;
+
+	//spl, bpl, sil and dil only exist with a REX prefix, without one they are ah to bh.
+	int byteRegisters = (rm->kind == OPERAND_REGISTER && rm->size == 1 && rm->base >= REG_RSP && rm->base <= REG_RDI)
+		|| (other && other->kind == OPERAND_REGISTER && other->size == 1 && other->base >= REG_RSP && other->base <= REG_RDI);
+
+	int rex = (wide ? REX_W : 0) | (reg & 8 ? REX_R : 0) | (rm->base & 8 ? REX_B : 0);
+	if ( rex || byteRegisters )
+	{
+		out[size++] = (unsigned char)(REX | rex);
+	}
+
+	memcpy_s( out + size, opcodeSize, opcode, opcodeSize );
+	size += opcodeSize;
+
+	return size + encodeModRm( out + size, reg, rm );
+}
+
+int encodeModRm( unsigned char* out, int reg, const operand_t* rm )
+{
+	int size = 0;
+	int base = rm->base & 7;
+
+	if ( rm->kind == OPERAND_REGISTER )
+	{
+		out[size++] = (unsigned char)(0xc0 | ((reg & 7) << 3) | base);
+		return size;
+	}
+
+	//No displacement byte when it is zero, except for rbp and r13 whose mod 0 means rip relative.
+	int mod = rm->displacement == 0 && base != REG_RBP ? 0 : fitsByte( rm->displacement ) ? 1 : 2;
+	out[size++] = (unsigned char)((mod << 6) | ((reg & 7) << 3) | base);
+
+	if ( base == REG_RSP )
+	{
+		//rsp and r12 can only be a base through a SIB byte.
+		out[size++] = 0x24;
+	}
+
+	if ( mod == 1 )
+		size += encodeImmediate( out + size, rm->displacement, 1 );
+	else if ( mod == 2 )
+		size += encodeImmediate( out + size, rm->displacement, 4 );
+
+	return size;
+}
+
+int encodeImmediate( unsigned char* out, int64_t value, int size )
+{
+	//Little endian, truncated to size.
+	for ( int i = 0; i < size; i++ )
+	{
+		out[i] = (unsigned char)(value >> (i * 8));
+	}
+	return size;
+}
+
+int fitsByte( int64_t value )
+{
+	return value >= -128 && value <= 127;
+}
@@ -0,0 +1,124 @@
+#pragma once
+#ifndef ENCODE_H
+#define ENCODE_H
+
+typedef enum Register
+{
+	REG_RAX,
+	REG_RCX,
+	REG_RDX,
+	REG_RBX,
+	REG_RSP,
+	REG_RBP,
+	REG_RSI,
+	REG_RDI,
+	REG_R8,
+	REG_R9,
+	REG_R10,
+	REG_R11,
+	REG_R12,
+	REG_R13,
+	REG_R14,
+	REG_R15
+} Register;
+
+typedef enum OperandKind
+{
+	OPERAND_NONE,
+	OPERAND_REGISTER,
+	OPERAND_MEMORY, //[base + displacement]
+	OPERAND_IMMEDIATE
+} OperandKind;
+
+typedef struct operand_s
+{
+	OperandKind kind;
+	int size; //1, 4 or 8 bytes, immediates take the size of the other operand.
+	Register base; //The register, or the base of a memory operand.
+	int32_t displacement;
+	int64_t immediate;
+} operand_t;
+
+typedef enum Mnemonic
+{
+	X86_ADD, //The ALU group, in the order of its /digit.
+	X86_OR,
+	X86_ADC,
+	X86_SBB,
+	X86_AND,
+	X86_SUB,
+	X86_XOR,
+	X86_CMP,
+	X86_MOV,
+	X86_MOVZX,
+	X86_INC,
+	X86_DEC,
+	X86_NEG,
+	X86_TEST,
+	X86_IMUL,
+	X86_SETCC,
+	X86_CMOVCC,
+	X86_CALL,
+	X86_JCC, //Conditional or not, to a label or out of the instructions.
+	X86_LABEL,
+	X86_RAW //Fixed bytes, see addRaw and addRawMemory.
+} Mnemonic;
+
+typedef enum Condition
+{
+	COND_E = 0x4,
+	COND_NE = 0x5,
+	COND_ALWAYS = 0x10
+} Condition;
+
+typedef struct instruction_s
+{
+	Mnemonic mnemonic;
+	Condition condition; //Jumps, setcc and cmovcc.
+	operand_t destination;
+	operand_t source;
+	int32_t factor; //Three operand imul, see addImul.
+	int hasFactor;
+	int label; //Placed by a label or jumped to, -1 for a jump out of the instructions.
+	const unsigned char* raw;
+	int rawSize;
+	int rawMemory; //The raw bytes end in a ModRM for [rbx + disp32], destination has the displacement.
+} instruction_t;
+
+typedef struct encoder_s
+{
+	instruction_t* instructions;
+	int count;
+	int capacity;
+	int labels; //Labels handed out so far.
+} encoder_t;
+
+extern operand_t registerOperand( Register base, int size );
+extern operand_t memoryOperand( Register base, int32_t displacement, int size );
+extern operand_t immediateOperand( int64_t value );
+extern operand_t noOperand();
+
+extern void initEncoder( encoder_t* encoder );
+extern void freeEncoder( encoder_t* encoder );
+
+extern int newLabel( encoder_t* encoder );
+extern void addLabel( encoder_t* encoder, int label );
+extern void addInstruction( encoder_t* encoder, Mnemonic mnemonic, operand_t destination, operand_t source );
+extern void addImul( encoder_t* encoder, operand_t destination, operand_t source, int32_t factor );
+extern void addConditional( encoder_t* encoder, Mnemonic mnemonic, Condition condition, operand_t destination, operand_t source );
+extern void addJump( encoder_t* encoder, Condition condition, int label );
+//Always rel32, the caller patches it once it knows where the target is.
+extern void addExit( encoder_t* encoder, Condition condition );
+//Code the encoder has no instructions for. The bytes must outlive the encoder.
+extern void addRaw( encoder_t* encoder, const unsigned char* bytes, int size );
+extern void addRawMemory( encoder_t* encoder, const unsigned char* bytes, int size, int32_t displacement );
+
+//Peephole pass over the instructions: pointer adjustments sink into the displacements of the
+//cell accesses after them and merge, compares already answered by the flags are dropped.
+extern void optimiseInstructions( encoder_t* encoder );
+
+//Shortest encoding of everything, jumps included. Exit fixups are the offsets of the rel32 of
+//every addExit jump.
+extern unsigned char* encodeInstructions( encoder_t* encoder, int* size, int** exitFixups, int* exitFixupsCount );
+
+#endif
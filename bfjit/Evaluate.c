@@ -0,0 +1,328 @@
+#include "extern_data.h"
+#include "Evaluate.h"
+#include <memory.h>
+#include <stdlib.h>
+
+typedef enum EvalStatus
+{
+	EVAL_OK,
+	EVAL_BLOCKED //Needs input, left the tape or ran out of steps.
+} EvalStatus;
+
+typedef struct evaluation_s
+{
+	const opcode_t* code;
+	int* jumps; //Matching bracket of every bracket.
+
+	unsigned char* tape;
+	int tapeSize;
+	int pointer;
+
+	unsigned char* output;
+	int outputSize;
+	int outputCapacity;
+
+	int64_t steps;
+
+	uint8_t tripCount; //Closed form loops, see OP_LOOP_COUNT.
+	uint8_t product;
+	uint8_t mask; //Branchless ifs, see OP_IF_MASK.
+} evaluation_t;
+
+static EvalStatus evaluateRange( evaluation_t* evaluation, int begin, int end );
+static int movePointer( evaluation_t* evaluation, int64_t amount );
+static void addOutput( evaluation_t* evaluation, unsigned char c );
+
+opcode_t* partialEvaluate( const opcode_t* code, int memorySize, int64_t steps )
+{
+	int opcodesCount = 0;
+	while ( code[opcodesCount].type != OP_CODE_END )
+	{
+		opcodesCount++;
+	}
+
+	evaluation_t evaluation;
+	evaluation.code = code;
+	evaluation.jumps = malloc( (opcodesCount + 1) * sizeof( int ) );
+	evaluation.tape = calloc( memorySize, 1 );
+	evaluation.tapeSize = memorySize;
+	evaluation.pointer = 0;
+	evaluation.outputCapacity = 256;
+	evaluation.output = malloc( evaluation.outputCapacity );
+	evaluation.outputSize = 0;
+	evaluation.steps = steps;
+
+	int* bracketStack = malloc( MAX_STACK_SIZE * sizeof( int ) );
+	int bracketStackIndex = 0;
+	for ( int i = 0; i < opcodesCount; i++ )
+	{
+		if ( code[i].type == OP_OPEN_BRACKET )
+		{
+			bracketStack[bracketStackIndex++] = i;
+		}
+		else if ( code[i].type == OP_CLOSE_BRACKET )
+		{
+			int open = bracketStack[--bracketStackIndex];
+			evaluation.jumps[open] = i;
+			evaluation.jumps[i] = open;
+		}
+	}
+	free( bracketStack );
+
+	//Run whole top-level statements so the residual program starts at a statement boundary.
+	//A loop that gets blocked part way through is rolled back to where it started.
+	unsigned char* snapshot = malloc( memorySize );
+	int stop = 0;
+	while ( stop < opcodesCount )
+	{
+		int next = code[stop].type == OP_OPEN_BRACKET ? evaluation.jumps[stop] + 1 : stop + 1;
+		if ( code[stop].type == OP_LOOP_COUNT )
+		{
+			//The trip count lives in a register, the ops using it go with it. Same for an if's mask.
+			while ( code[next].type == OP_MUL_ADD || code[next].type == OP_MUL_CELL || code[next].type == OP_ADD_PRODUCT )
+			{
+				next++;
+			}
+		}
+		else if ( code[stop].type == OP_IF_MASK )
+		{
+			while ( code[next].type == OP_IF_ADD || code[next].type == OP_IF_SET )
+			{
+				next++;
+			}
+		}
+
+		int pointer = evaluation.pointer;
+		int outputSize = evaluation.outputSize;
+		if ( next - stop > 1 )
+		{
+			memcpy_s( snapshot, memorySize, evaluation.tape, memorySize );
+		}
+
+		if ( evaluateRange( &evaluation, stop, next ) != EVAL_OK )
+		{
+			//Single ops check before they change anything, only loops need restoring.
+			if ( next - stop > 1 )
+			{
+				memcpy_s( evaluation.tape, memorySize, snapshot, memorySize );
+			}
+			evaluation.pointer = pointer;
+			evaluation.outputSize = outputSize;
+			break;
+		}
+
+		stop = next;
+	}
+	free( snapshot );
+
+	int cellsSet = 0;
+	for ( int i = 0; i < memorySize; i++ )
+	{
+		cellsSet += evaluation.tape[i] != 0;
+	}
+
+	//Residual program: the buffered output, the tape contents, the pointer and then the
+	//rest of the program.
+	opcode_t* residual = calloc( evaluation.outputSize + cellsSet + 1 + (opcodesCount - stop) + 1, sizeof( opcode_t ) );
+	int residualIndex = 0;
+
+	for ( int i = 0; i < evaluation.outputSize; i++ )
+	{
+		residual[residualIndex].type = OP_OUTPUT_CONST;
+		residual[residualIndex].value = evaluation.output[i];
+		residualIndex++;
+	}
+
+	for ( int i = 0; i < memorySize; i++ )
+	{
+		if ( evaluation.tape[i] )
+		{
+			residual[residualIndex].type = OP_SET;
+			residual[residualIndex].value = evaluation.tape[i];
+			residual[residualIndex].offset = i;
+			residualIndex++;
+		}
+	}
+
+	if ( evaluation.pointer )
+	{
+		residual[residualIndex].type = OP_ADD_PTR;
+		residual[residualIndex].value = evaluation.pointer;
+		residualIndex++;
+	}
+
+	memcpy_s( residual + residualIndex, (opcodesCount - stop + 1) * sizeof( opcode_t ), code + stop, (opcodesCount - stop + 1) * sizeof( opcode_t ) );
+
+	free( evaluation.jumps );
+	free( evaluation.tape );
+	free( evaluation.output );
+
+	return residual;
+}
+
+EvalStatus evaluateRange( evaluation_t* evaluation, int begin, int end )
+{
+	const opcode_t* code = evaluation->code;
+	unsigned char* tape = evaluation->tape;
+
+	for ( int i = begin; i < end; i++ )
+	{
+		if ( evaluation->steps-- <= 0 )
+		{
+			return EVAL_BLOCKED;
+		}
+
+		unsigned char* cell = &tape[evaluation->pointer];
+
+		switch ( code[i].type )
+		{
+		case OP_INC_PTR:
+			if ( ! movePointer( evaluation, 1 ) )
+				return EVAL_BLOCKED;
+			break;
+		case OP_DEC_PTR:
+			if ( ! movePointer( evaluation, -1 ) )
+				return EVAL_BLOCKED;
+			break;
+		case OP_ADD_PTR:
+			if ( ! movePointer( evaluation, code[i].value ) )
+				return EVAL_BLOCKED;
+			break;
+		case OP_SUB_PTR:
+			if ( ! movePointer( evaluation, -(int64_t)code[i].value ) )
+				return EVAL_BLOCKED;
+			break;
+		case OP_INC:
+			(*cell)++;
+			break;
+		case OP_DEC:
+			(*cell)--;
+			break;
+		case OP_ADD:
+			*cell += code[i].value;
+			break;
+		case OP_SUB:
+			*cell -= code[i].value;
+			break;
+		case OP_ZERO:
+			*cell = 0;
+			break;
+		case OP_SET:
+			{
+				int64_t target = (int64_t)evaluation->pointer + code[i].offset;
+				if ( target < 0 || target >= evaluation->tapeSize )
+					return EVAL_BLOCKED;
+				tape[target] = (unsigned char)code[i].value;
+			}
+			break;
+		case OP_OUTPUT_CHAR:
+			addOutput( evaluation, *cell );
+			break;
+		case OP_OUTPUT_CONST:
+			addOutput( evaluation, (unsigned char)code[i].value );
+			break;
+		case OP_LOOP_COUNT:
+			evaluation->tripCount = *cell * (uint8_t)code[i].value;
+			break;
+		case OP_MUL_ADD:
+		case OP_MUL_CELL:
+		case OP_ADD_PRODUCT:
+			{
+				int64_t target = (int64_t)evaluation->pointer + code[i].offset;
+				if ( target < 0 || target >= evaluation->tapeSize )
+					return EVAL_BLOCKED;
+
+				if ( code[i].type == OP_MUL_ADD )
+					tape[target] += evaluation->tripCount * (uint8_t)code[i].value;
+				else if ( code[i].type == OP_MUL_CELL )
+					evaluation->product = evaluation->tripCount * tape[target] * (uint8_t)code[i].value;
+				else
+					tape[target] += evaluation->product;
+			}
+			break;
+		case OP_IF_MASK:
+			evaluation->mask = *cell ? 0xff : 0;
+			break;
+		case OP_IF_ADD:
+		case OP_IF_SET:
+			{
+				int64_t target = (int64_t)evaluation->pointer + code[i].offset;
+				if ( target < 0 || target >= evaluation->tapeSize )
+					return EVAL_BLOCKED;
+
+				if ( ! evaluation->mask )
+					break;
+
+				if ( code[i].type == OP_IF_ADD )
+					tape[target] += (uint8_t)code[i].value;
+				else
+					tape[target] = (uint8_t)code[i].value;
+			}
+			break;
+		case OP_VECTOR_SET:
+		case OP_VECTOR_ADD:
+			{
+				int64_t target = (int64_t)evaluation->pointer + code[i].offset;
+				if ( target < 0 || target + VECTOR_CELLS > evaluation->tapeSize )
+					return EVAL_BLOCKED;
+
+				for ( int j = 0; j < VECTOR_CELLS; j++ )
+				{
+					if ( code[i].type == OP_VECTOR_SET )
+						tape[target + j] = (uint8_t)code[i].value;
+					else
+						tape[target + j] += (uint8_t)code[i].value;
+				}
+			}
+			break;
+		case OP_SCAN_RIGHT:
+		case OP_SCAN_LEFT:
+			while ( tape[evaluation->pointer] )
+			{
+				if ( ! movePointer( evaluation, code[i].type == OP_SCAN_RIGHT ? 1 : -1 ) || evaluation->steps-- <= 0 )
+					return EVAL_BLOCKED;
+			}
+			break;
+		case OP_INPUT_CHAR:
+			return EVAL_BLOCKED;
+		case OP_OPEN_BRACKET:
+			{
+				int close = evaluation->jumps[i];
+				while ( tape[evaluation->pointer] )
+				{
+					if ( evaluateRange( evaluation, i + 1, close ) != EVAL_OK || evaluation->steps-- <= 0 )
+					{
+						return EVAL_BLOCKED;
+					}
+				}
+				i = close;
+			}
+			break;
+		}
+	}
+
+	return EVAL_OK;
+}
+
+int movePointer( evaluation_t* evaluation, int64_t amount )
+{
+	int64_t pointer = evaluation->pointer + amount;
+	if ( pointer < 0 || pointer >= evaluation->tapeSize )
+	{
+		return 0;
+	}
+
+	evaluation->pointer = (int)pointer;
+	return 1;
+}
+
+void addOutput( evaluation_t* evaluation, unsigned char c )
+{
+	if ( evaluation->outputSize == evaluation->outputCapacity )
+	{
+		evaluation->outputCapacity *= 2;
+		evaluation->output = realloc( evaluation->output, evaluation->outputCapacity );
+	}
+
+	evaluation->output[evaluation->outputSize++] = c;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#ifndef EVALUATE_H
+#define EVALUATE_H
+
+#define DEFAULT_EVALUATE_STEPS 10000000
+
+//Runs the program at compile time until it first needs input (or runs out of steps or tape)
+//and returns a new program that starts from the state it got to.
+extern opcode_t* partialEvaluate( const opcode_t* code, int memorySize, int64_t steps );
+
+#endif
@@ -1,19 +1,3 @@
-
-
-typedef struct instruction_s
-{
-	const unsigned char* opcode;
-	int size;
-	int argument;
-} instruction_t;
-
-
-
-#define setInstruction(opcode_enum, opcode_array, arg) \
-instructionSet[opcode_enum].opcode = opcode_array; \
-instructionSet[opcode_enum].size = sizeof(opcode_array); \
-instructionSet[opcode_enum].argument = arg;
-
 //#ifndef _WIN32
 const unsigned char op_header[] =
 {
@@ -21,88 +5,248 @@ const unsigned char op_header[] =
 	0x57, //push rdi
 	0x56, //push rsi
 	0x53, //push rbx
+	0x41,0x54, //push r12
 	0x55, //push rbp
 	0x48,0x89,0xe5, //mov rbp, rsp; home space?
 	0x48,0x83,0xec,0x20, //sub rsp, 0x28
 
 	0x4c,0x89,0xc3, //mov rbx, r8
 	0x48,0x89,0xcf,//mov rdi, rcx
-	0x48,0x89,0xd6  //mov rsi, rdx
+	0x48,0x89,0xd6, //mov rsi, rdx
+	0x4d,0x89,0xcc  //mov r12, r9 (fuel counter, may be NULL)
+};
+
+const unsigned char op_scanRight[] =
+{
+	0xeb,0x03, //jmp test
+	0x48,0xff,0xc3, //loop: inc rbx
+	0x80,0x3b,0x00, //test: cmp [rbx], byte 0
+	0x75,0xf8 //jne loop
+};
+
+const unsigned char op_scanLeft[] =
+{
+	0xeb,0x03, //jmp test
+	0x48,0xff,0xcb, //loop: dec rbx
+	0x80,0x3b,0x00, //test: cmp [rbx], byte 0
+	0x75,0xf8 //jne loop
+};
+
+//Vector scans only ever load aligned blocks holding at least one cell the byte loop
+//would have read, so they never touch a page the scalar version would not.
+const unsigned char op_scanRightSse2[] =
+{
+	0x48,0x89,0xda, //mov rdx, rbx
+	0x48,0x83,0xe2,0xf0, //and rdx, -16
+	0x89,0xd9, //mov ecx, ebx
+	0x83,0xe1,0x0f, //and ecx, 15
+	0x66,0x0f,0xef,0xc0, //pxor xmm0, xmm0
+	0x66,0x0f,0x6f,0x0a, //movdqa xmm1, [rdx]
+	0x66,0x0f,0x74,0xc8, //pcmpeqb xmm1, xmm0
+	0x66,0x0f,0xd7,0xc1, //pmovmskb eax, xmm1
+	0xd3,0xe8, //shr eax, cl (drop the cells below the pointer)
+	0x85,0xc0, //test eax, eax
+	0x75,0x17, //jne found
+	0x48,0x83,0xc2,0x10, //loop: add rdx, 16
+	0x66,0x0f,0x6f,0x0a, //movdqa xmm1, [rdx]
+	0x66,0x0f,0x74,0xc8, //pcmpeqb xmm1, xmm0
+	0x66,0x0f,0xd7,0xc1, //pmovmskb eax, xmm1
+	0x85,0xc0, //test eax, eax
+	0x74,0xec, //je loop
+	0x48,0x89,0xd3, //mov rbx, rdx
+	0x0f,0xbc,0xc0, //found: bsf eax, eax
+	0x48,0x01,0xc3 //add rbx, rax
+};
+
+const unsigned char op_scanLeftSse2[] =
+{
+	0x48,0x89,0xda, //mov rdx, rbx
+	0x48,0x83,0xe2,0xf0, //and rdx, -16
+	0x89,0xd9, //mov ecx, ebx
+	0x83,0xe1,0x0f, //and ecx, 15
+	0x83,0xf1,0x1f, //xor ecx, 31
+	0x66,0x0f,0xef,0xc0, //pxor xmm0, xmm0
+	0x66,0x0f,0x6f,0x0a, //movdqa xmm1, [rdx]
+	0x66,0x0f,0x74,0xc8, //pcmpeqb xmm1, xmm0
+	0x66,0x0f,0xd7,0xc1, //pmovmskb eax, xmm1
+	0xd3,0xe0, //shl eax, cl (the pointer's cell lands on bit 31, the ones above drop off)
+	0x85,0xc0, //test eax, eax
+	0x75,0x18, //jne found
+	0x48,0x83,0xea,0x10, //loop: sub rdx, 16
+	0x66,0x0f,0x6f,0x0a, //movdqa xmm1, [rdx]
+	0x66,0x0f,0x74,0xc8, //pcmpeqb xmm1, xmm0
+	0x66,0x0f,0xd7,0xc1, //pmovmskb eax, xmm1
+	0x85,0xc0, //test eax, eax
+	0x74,0xec, //je loop
+	0x48,0x8d,0x5a,0x1f, //lea rbx, [rdx + 31]
+	0x0f,0xbd,0xc0, //found: bsr eax, eax
+	0x48,0x8d,0x5c,0x03,0xe1 //lea rbx, [rbx + rax - 31]
 };
 
-const unsigned char op_incRBX[] =
+const unsigned char op_scanRightAvx2[] =
 {
-	0x48,0xff,0xc3 //inc rbx
+	0x48,0x89,0xda, //mov rdx, rbx
+	0x48,0x83,0xe2,0xe0, //and rdx, -32
+	0x89,0xd9, //mov ecx, ebx
+	0x83,0xe1,0x1f, //and ecx, 31
+	0xc5,0xf9,0xef,0xc0, //vpxor xmm0, xmm0, xmm0
+	0xc5,0xfd,0x74,0x0a, //vpcmpeqb ymm1, ymm0, [rdx]
+	0xc5,0xfd,0xd7,0xc1, //vpmovmskb eax, ymm1
+	0xd3,0xe8, //shr eax, cl
+	0x85,0xc0, //test eax, eax
+	0x75,0x13, //jne found
+	0x48,0x83,0xc2,0x20, //loop: add rdx, 32
+	0xc5,0xfd,0x74,0x0a, //vpcmpeqb ymm1, ymm0, [rdx]
+	0xc5,0xfd,0xd7,0xc1, //vpmovmskb eax, ymm1
+	0x85,0xc0, //test eax, eax
+	0x74,0xf0, //je loop
+	0x48,0x89,0xd3, //mov rbx, rdx
+	0x0f,0xbc,0xc0, //found: bsf eax, eax
+	0x48,0x01,0xc3, //add rbx, rax
+	0xc5,0xf8,0x77 //vzeroupper (getchar and putchar are SSE code)
 };
 
-const unsigned char op_decRBX[] =
+const unsigned char op_scanLeftAvx2[] =
 {
-	0x48,0xff,0xcb //dec rbx
+	0x48,0x89,0xda, //mov rdx, rbx
+	0x48,0x83,0xe2,0xe0, //and rdx, -32
+	0x89,0xd9, //mov ecx, ebx
+	0x83,0xe1,0x1f, //and ecx, 31
+	0x83,0xf1,0x1f, //xor ecx, 31
+	0xc5,0xf9,0xef,0xc0, //vpxor xmm0, xmm0, xmm0
+	0xc5,0xfd,0x74,0x0a, //vpcmpeqb ymm1, ymm0, [rdx]
+	0xc5,0xfd,0xd7,0xc1, //vpmovmskb eax, ymm1
+	0xd3,0xe0, //shl eax, cl
+	0x85,0xc0, //test eax, eax
+	0x75,0x14, //jne found
+	0x48,0x83,0xea,0x20, //loop: sub rdx, 32
+	0xc5,0xfd,0x74,0x0a, //vpcmpeqb ymm1, ymm0, [rdx]
+	0xc5,0xfd,0xd7,0xc1, //vpmovmskb eax, ymm1
+	0x85,0xc0, //test eax, eax
+	0x74,0xf0, //je loop
+	0x48,0x8d,0x5a,0x1f, //lea rbx, [rdx + 31]
+	0x0f,0xbd,0xc0, //found: bsr eax, eax
+	0x48,0x8d,0x5c,0x03,0xe1, //lea rbx, [rbx + rax - 31]
+	0xc5,0xf8,0x77 //vzeroupper
 };
 
-const unsigned char op_addRBX[] = //this instruction is 4 bytes larger than this size
+const unsigned char op_scanRightAvx512[] =
 {
-	0x48,0x81,0xc3 //add rbx, x (where x is a 4 byte integer)
+	0x48,0x89,0xda, //mov rdx, rbx
+	0x48,0x83,0xe2,0xc0, //and rdx, -64
+	0x89,0xd9, //mov ecx, ebx
+	0x83,0xe1,0x3f, //and ecx, 63
+	0x62,0xf1,0xfd,0x48,0x6f,0x0a, //vmovdqa64 zmm1, [rdx]
+	0x62,0xf2,0x76,0x48,0x26,0xc9, //vptestnmb k1, zmm1, zmm1
+	0xc4,0xe1,0xfb,0x93,0xc1, //kmovq rax, k1
+	0x48,0xd3,0xe8, //shr rax, cl
+	0x48,0x85,0xc0, //test rax, rax
+	0x75,0x1d, //jne found
+	0x48,0x83,0xc2,0x40, //loop: add rdx, 64
+	0x62,0xf1,0xfd,0x48,0x6f,0x0a, //vmovdqa64 zmm1, [rdx]
+	0x62,0xf2,0x76,0x48,0x26,0xc9, //vptestnmb k1, zmm1, zmm1
+	0xc4,0xe1,0xfb,0x93,0xc1, //kmovq rax, k1
+	0x48,0x85,0xc0, //test rax, rax
+	0x74,0xe6, //je loop
+	0x48,0x89,0xd3, //mov rbx, rdx
+	0x48,0x0f,0xbc,0xc0, //found: bsf rax, rax
+	0x48,0x01,0xc3, //add rbx, rax
+	0xc5,0xf8,0x77 //vzeroupper
 };
 
-const unsigned char op_subRBX[] = //this instruction is 4 bytes larger than this size
+const unsigned char op_scanLeftAvx512[] =
 {
-	0x48,0x81,0xeb //sub rbx, x (where x is a 4 byte integer)
+	0x48,0x89,0xda, //mov rdx, rbx
+	0x48,0x83,0xe2,0xc0, //and rdx, -64
+	0x89,0xd9, //mov ecx, ebx
+	0x83,0xe1,0x3f, //and ecx, 63
+	0x83,0xf1,0x3f, //xor ecx, 63
+	0x62,0xf1,0xfd,0x48,0x6f,0x0a, //vmovdqa64 zmm1, [rdx]
+	0x62,0xf2,0x76,0x48,0x26,0xc9, //vptestnmb k1, zmm1, zmm1
+	0xc4,0xe1,0xfb,0x93,0xc1, //kmovq rax, k1
+	0x48,0xd3,0xe0, //shl rax, cl
+	0x48,0x85,0xc0, //test rax, rax
+	0x75,0x1e, //jne found
+	0x48,0x83,0xea,0x40, //loop: sub rdx, 64
+	0x62,0xf1,0xfd,0x48,0x6f,0x0a, //vmovdqa64 zmm1, [rdx]
+	0x62,0xf2,0x76,0x48,0x26,0xc9, //vptestnmb k1, zmm1, zmm1
+	0xc4,0xe1,0xfb,0x93,0xc1, //kmovq rax, k1
+	0x48,0x85,0xc0, //test rax, rax
+	0x74,0xe6, //je loop
+	0x48,0x8d,0x5a,0x3f, //lea rbx, [rdx + 63]
+	0x48,0x0f,0xbd,0xc0, //found: bsr rax, rax
+	0x48,0x8d,0x5c,0x03,0xc1, //lea rbx, [rbx + rax - 63]
+	0xc5,0xf8,0x77 //vzeroupper
 };
 
-const unsigned char op_inc[] =
+//Vector ops broadcast the byte repeated in eax to xmm0/ymm0 and work on VECTOR_CELLS cells, or twice
+//that with AVX2. The encoder adds the 4 byte offsets.
+const unsigned char op_vectorBroadcast[] =
 {
-	0xfe,0x03 //inc byte [rbx]
+	0x66,0x0f,0x6e,0xc0, //movd xmm0, eax
+	0x66,0x0f,0x70,0xc0,0x00 //pshufd xmm0, xmm0, 0
 };
 
-const unsigned char op_dec[] =
+const unsigned char op_vectorStore[] = //this instruction is 4 bytes larger than this size
 {
-	0xfe,0x0b //dec byte [rbx]
+	0xf3,0x0f,0x7f,0x83 //movdqu [rbx + x], xmm0 (where x is a 4 byte offset)
 };
 
-const unsigned char op_add[] = //this instruction is 4 bytes larger than this size
+const unsigned char op_vectorLoad[] = //this instruction is 4 bytes larger than this size, then op_vectorAddStore
 {
-	0x80, 0x03 //add [rbx], byte x (where x is a 4 byte integer)
+	0xf3,0x0f,0x6f,0x8b //movdqu xmm1, [rbx + x] (where x is a 4 byte offset)
 };
 
-const unsigned char op_sub[] = //this instruction is 4 bytes larger than this size
+const unsigned char op_vectorAddStore[] = //this instruction is 4 bytes larger than this size
 {
-	0x80, 0x2b //sub [rbx], byte x (where x is a 4 byte integer)
+	0x66,0x0f,0xfc,0xc8, //paddb xmm1, xmm0
+	0xf3,0x0f,0x7f,0x8b //movdqu [rbx + x], xmm1 (where x is a 4 byte offset)
 };
 
-const unsigned char op_zero[] =
+const unsigned char op_vectorBroadcastAvx2[] =
 {
-	0xc6,0x03,0x00 //mov [rbx], byte 0
+	0xc5,0xf9,0x6e,0xc0, //vmovd xmm0, eax
+	0xc4,0xe2,0x7d,0x58,0xc0 //vpbroadcastd ymm0, xmm0
 };
 
-const unsigned char op_getChar[] =
+const unsigned char op_vectorStoreAvx2[] = //this instruction is 4 bytes larger than this size
 {
-	0xff,0xd7, //call rdi (getchar)
-	//0x3c,0x0d, //cmp al, 0x0a
-	//0x75, 0x02,
-	//0xb0, 0x0a,
-	//0x74,0xfa, //je -6
-	0x88,0x03 //mov [rbx], al
+	0xc5,0xfe,0x7f,0x83 //vmovdqu [rbx + x], ymm0 (where x is a 4 byte offset)
 };
 
-const unsigned char op_putChar[] =
+const unsigned char op_vectorAddAvx2[] = //this instruction is 4 bytes larger than this size, then op_vectorAddStoreAvx2
 {
-	0x48,0x0f,0xb6,0x0b, //movzx rcx, byte [rbx]
-	0xff,0xd6 //call rsi (putchar)
+	0xc5,0xfd,0xfc,0x8b //vpaddb ymm1, ymm0, [rbx + x] (where x is a 4 byte offset)
 };
 
-const unsigned char op_openBracket[] = //this instruction is 4 bytes larger than this size
+const unsigned char op_vectorAddStoreAvx2[] = //this instruction is 4 bytes larger than this size
 {
-	0x80,0x3b,0x00, //cmp [rbx], byte 0
-	0x0f, 0x84 //je x (where x is a 4 byte offset)
+	0xc5,0xfe,0x7f,0x8b //vmovdqu [rbx + x], ymm1 (where x is a 4 byte offset)
 };
 
-#define JNE_OPERAND_SIZE 2
+const unsigned char op_vzeroupper[] =
+{
+	0xc5,0xf8,0x77 //vzeroupper (getchar and putchar are SSE code)
+};
+
+const unsigned char op_returnOk[] =
+{
+	0x31,0xc0 //xor eax, eax (RUN_OK)
+};
+
+const unsigned char op_returnLimitReached[] =
+{
+	0xb8,0x01,0x00,0x00,0x00 //mov eax, RUN_LIMIT_REACHED
+};
+
+const unsigned char op_returnTapeOverflow[] =
+{
+	0xb8,0x02,0x00,0x00,0x00 //mov eax, RUN_TAPE_OVERFLOW
+};
 
-const unsigned char op_closeBracket[] = //this instruction is 4 bytes larger than this size
+const unsigned char op_jmpShort[] = //this instruction is 1 byte larger than this size
 {
-	0x80,0x3b,0x00, //cmp [rbx], byte 0
-	0x0f,0x85 //jne x (where x is a 4 byte offset)
+	0xeb //jmp x (where x is a 1 byte offset)
 };
 
 const unsigned char op_footer[] =
@@ -110,6 +254,7 @@ const unsigned char op_footer[] =
 	0x48,0x83,0xc4,0x20, //add rsp, 0x28; home space?
 	0x48, 0x89, 0xec, //mov rsp, rbp
 	0x5d, //pop rbp
+	0x41,0x5c, //pop r12
 	0x5b, //pop rbx
 	0x5e, //pop rsi
 	0x5f, //pop rdi
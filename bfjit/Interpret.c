@@ -0,0 +1,85 @@
+#include "extern_data.h"
+#include "Runtime.h"
+#include "Interpret.h"
+#include <stdlib.h>
+#include <string.h>
+
+RunStatus interpret( const char* text, unsigned char* memory, int memorySize, int start, getChar_t getChar, putChar_t putChar, int64_t* fuel )
+{
+	int length = (int)strlen( text );
+
+	//Matching bracket for every bracket in the text.
+	int* jumps = malloc( (length + 1) * sizeof( int ) );
+	int* bracketStack = malloc( (length + 1) * sizeof( int ) );
+	int bracketStackIndex = 0;
+
+	for ( int i = 0; i < length; i++ )
+	{
+		if ( text[i] == '[' )
+		{
+			bracketStack[bracketStackIndex++] = i;
+		}
+		else if ( text[i] == ']' && bracketStackIndex > 0 )
+		{
+			int open = bracketStack[--bracketStackIndex];
+			jumps[open] = i;
+			jumps[i] = open;
+		}
+	}
+	free( bracketStack );
+
+	RunStatus status = RUN_OK;
+	int pointer = start;
+
+	for ( int i = 0; i < length && status == RUN_OK; i++ )
+	{
+		switch ( text[i] )
+		{
+		case '+':
+			memory[pointer]++;
+			break;
+		case '-':
+			memory[pointer]--;
+			break;
+		case '>':
+			if ( ++pointer >= memorySize )
+			{
+				status = RUN_TAPE_OVERFLOW;
+			}
+			break;
+		case '<':
+			if ( --pointer < 0 )
+			{
+				status = RUN_TAPE_OVERFLOW;
+			}
+			break;
+		case '.':
+			putChar( memory[pointer] );
+			break;
+		case ',':
+			memory[pointer] = (unsigned char)getChar();
+			break;
+		case '[':
+			if ( memory[pointer] == 0 )
+			{
+				i = jumps[i];
+			}
+			break;
+		case ']':
+			//Same accounting as the JIT, one unit per back-edge check.
+			if ( --(*fuel) == 0 )
+			{
+				status = RUN_LIMIT_REACHED;
+			}
+			else if ( memory[pointer] != 0 )
+			{
+				i = jumps[i];
+			}
+			break;
+		}
+	}
+
+	free( jumps );
+
+	return status;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#ifndef INTERPRET_H
+#define INTERPRET_H
+
+//Straight interpreter over the source text, kept free of every optimisation so the JIT
+//can be checked against it. The source must be well bracketed.
+extern RunStatus interpret( const char* text, unsigned char* memory, int memorySize, int start, getChar_t getChar, putChar_t putChar, int64_t* fuel );
+
+#endif
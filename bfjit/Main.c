@@ -1,20 +1,28 @@
 ﻿#include "extern_data.h"
 #include "Assemble.h"
 #include "Compile.h"
+#include "Runtime.h"
+#include "Evaluate.h"
+#include "Analyse.h"
+#include "Output.h"
+#include "Profile.h"
+#include "Cpu.h"
+#include "Server.h"
+#include "Verify.h"
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <Windows.h>
 #include <conio.h>
 
-#define MAX_MEMORY_SIZE 5000
-
-static void* prepareMachineCode(void* code, int size);
-static void executeMachineCode(void* code, int dump );
-static void dumpMemory( unsigned char* memory );
+static RunStatus executeMachineCode( void* code, const tapeRange_t* range, int dump, int64_t maxSteps, DWORD timeoutMs, int largePages, int pipeOutput );
+static VOID CALLBACK onTimeout( PVOID fuel, BOOLEAN timerFired );
+static void dumpMemory( const tape_t* tape );
+static void printTapeRange( const tapeRange_t* range );
 static void dumpMachineCode( unsigned char* code, int size, const char* filename );
-static void freeMachineCode( void* code );
+static int runClient( const char* path, const char* filename, int64_t maxSteps, int* exitCode );
 
+#ifndef BFJIT_FUZZER
 int main(int argc, char** argv)
 {
 	/*if ( argc <= 1 )
@@ -25,6 +33,24 @@ int main(int argc, char** argv)
 
 	int dump = 0;
 	int dumpCode = 1;
+	int64_t maxSteps = 0;
+	DWORD timeoutMs = 0;
+	int verify = 0;
+	const char* inputFilename = NULL;
+	int evaluate = 0;
+	int largePages = 0;
+	int pipeOutput = 0;
+	int analyse = 0;
+	int profile = 0;
+	const char* profileJson = NULL;
+	int cpuInfo = 0;
+	int cpuLevelForced = 0;
+	int64_t evaluateSteps = DEFAULT_EVALUATE_STEPS;
+	int fuzzIterations = 0;
+	uint32_t fuzzSeed = 1;
+	const char* servePath = NULL;
+	const char* clientPath = NULL;
+	int workers = 0;
 	const char* filename = "calc.bf";
 	for ( int i = 1; i < argc; i++ )
 	{
@@ -36,27 +62,201 @@ int main(int argc, char** argv)
 
 		dump |= (strcmp( "-dump", argv[i] ) == 0);
 		dumpCode |= (strcmp( "-dump_code", argv[i] ) == 0);
+		verify |= (strcmp( "-verify", argv[i] ) == 0);
+		evaluate |= (strcmp( "-partial_eval", argv[i] ) == 0);
+		largePages |= (strcmp( "-large_pages", argv[i] ) == 0);
+		pipeOutput |= (strcmp( "-pipe_output", argv[i] ) == 0);
+		analyse |= (strcmp( "-analyze", argv[i] ) == 0);
+		profile |= (strcmp( "-profile", argv[i] ) == 0);
+		cpuInfo |= (strcmp( "-cpu_info", argv[i] ) == 0);
+
+		if ( strcmp( "-max_steps", argv[i] ) == 0 && i + 1 < argc )
+		{
+			maxSteps = _strtoi64( argv[++i], NULL, 10 );
+		}
+		else if ( strcmp( "-timeout", argv[i] ) == 0 && i + 1 < argc )
+		{
+			timeoutMs = strtoul( argv[++i], NULL, 10 );
+		}
+		else if ( strcmp( "-input", argv[i] ) == 0 && i + 1 < argc )
+		{
+			inputFilename = argv[++i];
+		}
+		else if ( strcmp( "-partial_eval_steps", argv[i] ) == 0 && i + 1 < argc )
+		{
+			evaluateSteps = _strtoi64( argv[++i], NULL, 10 );
+		}
+		else if ( strcmp( "-profile_json", argv[i] ) == 0 && i + 1 < argc )
+		{
+			profileJson = argv[++i];
+		}
+		else if ( strcmp( "-cpu", argv[i] ) == 0 && i + 1 < argc )
+		{
+			//Force a code generation level, lets one machine exercise every variant.
+			CpuLevel level;
+			if ( ! parseCpuLevel( argv[++i], &level ) )
+			{
+				fprintf( stderr, "Unknown CPU level %s, expected scalar, sse2, avx2 or avx512.\n", argv[i] );
+				return EXIT_FAILURE;
+			}
+			cpuLevelForced = 1;
+			if ( ! setCpuLevel( level ) )
+			{
+				fprintf( stderr, "This CPU does not support %s, using %s.\n", argv[i], getCpuLevelName( getCpuLevel() ) );
+			}
+		}
+		else if ( strcmp( "-serve", argv[i] ) == 0 && i + 1 < argc )
+		{
+			servePath = argv[++i];
+		}
+		else if ( strcmp( "-workers", argv[i] ) == 0 && i + 1 < argc )
+		{
+			workers = atoi( argv[++i] );
+		}
+		else if ( strcmp( "-client", argv[i] ) == 0 && i + 1 < argc )
+		{
+			clientPath = argv[++i];
+		}
+		else if ( strcmp( "-fuzz", argv[i] ) == 0 && i + 1 < argc )
+		{
+			fuzzIterations = atoi( argv[++i] );
+		}
+		else if ( strcmp( "-seed", argv[i] ) == 0 && i + 1 < argc )
+		{
+			fuzzSeed = strtoul( argv[++i], NULL, 10 );
+		}
 	}
 
+	if ( cpuInfo )
+	{
+		printCpuInfo();
+		return EXIT_SUCCESS;
+	}
+
+	if ( fuzzIterations > 0 )
+	{
+		return fuzz( fuzzSeed, fuzzIterations ) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if ( verify )
+	{
+		//Compare the JIT against the interpreter on this program, stdin is the input unless -input names a file.
+		VerifyResult result = verifyFile( filename, inputFilename );
+		printf( "%s\n", result == VERIFY_MATCH ? "match" : result == VERIFY_MISMATCH ? "mismatch" : "skipped" );
+		return result == VERIFY_MISMATCH ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if ( servePath )
+	{
+		serve( servePath, workers, timeoutMs );
+		return EXIT_FAILURE;
+	}
+
+	//With BFJIT_SERVER set existing scripts run on a warm server unchanged, options that
+	//need the local tape, timings, memory or code generation level keep running here.
+	const char* serverPath = clientPath;
+	if ( ! serverPath && ! (dump || analyse || evaluate || profile || profileJson || timeoutMs > 0
+		|| largePages || pipeOutput || cpuLevelForced) )
+	{
+		serverPath = getenv( SERVER_ENVIRONMENT );
+	}
+
+	if ( serverPath )
+	{
+		int exitCode;
+		if ( runClient( serverPath, filename, maxSteps, &exitCode ) )
+		{
+			return exitCode;
+		}
+		if ( clientPath )
+		{
+			fprintf( stderr, "No server listening on %s\n", clientPath );
+			return EXIT_FAILURE;
+		}
+	}
+
+	int assembleFlags = 0;
+	if ( maxSteps > 0 || timeoutMs > 0 )
+	{
+		assembleFlags |= ASM_FUEL_CHECKS;
+	}
+
+	if ( profile || profileJson )
+	{
+		enableProfiling();
+	}
+
+	beginPhase( PHASE_COMPILE );
+
 	opcode_t* opcodes = compile( filename );
 
+	if ( opcodes && evaluate )
+	{
+		//Pay for the input independent start of the program once, here.
+		opcode_t* residual = partialEvaluate( opcodes, MAX_MEMORY_SIZE, evaluateSteps );
+		free( opcodes );
+		opcodes = residual;
+	}
+
+	//Size the tape for the cells this program can actually reach.
+	tapeRange_t range;
+	if ( opcodes )
+	{
+		analyseTapeRange( opcodes, &range );
+
+		if ( analyse )
+		{
+			printTapeRange( &range );
+			free( opcodes );
+			return EXIT_SUCCESS;
+		}
+	}
+
 	if ( opcodes )
 	{
 		int codeSize;
-		unsigned char* machineCode = assemble( opcodes, &codeSize );
+		unsigned char* machineCode = assemble( opcodes, &codeSize, assembleFlags );
+		endPhase( PHASE_COMPILE );
 
 		if ( dumpCode )
 			dumpMachineCode( machineCode, codeSize, filename );
 
 		if ( machineCode )
 		{
-			void* executableCode = prepareMachineCode( machineCode, codeSize );
+			int codeLargePages;
+			beginPhase( PHASE_COMPILE );
+			void* executableCode = prepareMachineCode( machineCode, codeSize, largePages ? PAGES_LARGE : 0, &codeLargePages );
 			free( machineCode );
+			endPhase( PHASE_COMPILE );
+
+			if ( largePages )
+			{
+				fprintf( stderr, "Large pages for code: %s\n", codeLargePages ? "yes" : "no" );
+			}
 
 			if ( executableCode )
 			{
-				executeMachineCode( executableCode, dump );
+				RunStatus status = executeMachineCode( executableCode, &range, dump, maxSteps, timeoutMs, largePages, pipeOutput );
 				freeMachineCode( executableCode );
+
+				if ( profile )
+				{
+					printProfile();
+				}
+				if ( profileJson && ! writeProfileJson( profileJson ) )
+				{
+					fprintf( stderr, "Failed to write %s.\n", profileJson );
+				}
+
+				if ( status == RUN_LIMIT_REACHED )
+				{
+					fprintf( stderr, "Execution limit reached.\n" );
+					return EXIT_FAILURE;
+				}
+				if ( status == RUN_TAPE_OVERFLOW )
+				{
+					return EXIT_FAILURE;
+				}
 			}
 			else
 			{
@@ -72,72 +272,165 @@ int main(int argc, char** argv)
 
 	return EXIT_SUCCESS;
 }
+#endif
 
-void* prepareMachineCode( void* code, int size )
+RunStatus executeMachineCode( void* code, const tapeRange_t* range, int dump, int64_t maxSteps, DWORD timeoutMs, int largePages, int pipeOutput )
 {
-	void* executableMemory = VirtualAlloc( NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
-	memcpy_s( executableMemory, size, code, size );
-	DWORD oldProtection;
-	if ( VirtualProtect( executableMemory, size, PAGE_EXECUTE_READ, &oldProtection ) )
+	tape_t tape;
+	if ( ! allocateTape( &tape, range, largePages ? PAGES_LARGE : 0 ) )
 	{
-		return executableMemory;
+		fprintf( stderr, "Failed to allocate tape.\n" );
+		return RUN_TAPE_OVERFLOW;
 	}
-	else
+
+	if ( largePages )
 	{
-		freeMachineCode( executableMemory );
-		return NULL;
+		fprintf( stderr, "Large pages for tape: %s\n", tape.largePages ? "yes" : "no" );
 	}
-}
 
-void executeMachineCode( void* code, int dump )
-{
-	void (*function)(void*, void*, void*);
+	//Fuel is only read by code assembled with ASM_FUEL_CHECKS, a time limit alone
+	//gets as much fuel as we can give it.
+	volatile int64_t fuel = maxSteps > 0 ? maxSteps : INT64_MAX;
+
+	HANDLE timer = NULL;
+	if ( timeoutMs > 0 )
+	{
+		//Keep firing after the deadline, the generated code's decrement is not atomic
+		//and can overwrite a single store.
+		if ( ! CreateTimerQueueTimer( &timer, NULL, onTimeout, (PVOID)&fuel, timeoutMs, 10, WT_EXECUTEINTIMERTHREAD ) )
+		{
+			fprintf( stderr, "Failed to create timeout timer.\n" );
+			timer = NULL;
+		}
+	}
 
-	function = code;
+	RunStatus status;
+	if ( pipeOutput && startOutputWriter() )
+	{
+		//Output goes through the writer thread instead of blocking in putchar.
+		beginPhase( PHASE_EXECUTE );
+		status = runMachineCode( code, pipelinedGetChar, pipelinedPutChar, tape.start, &fuel );
+		if ( ! stopOutputWriter() )
+		{
+			fprintf( stderr, "Failed to write output.\n" );
+		}
+		endPhase( PHASE_EXECUTE );
+	}
+	else
+	{
+		beginPhase( PHASE_EXECUTE );
+		status = runMachineCode( code, getchar, putchar, tape.start, &fuel );
+		endPhase( PHASE_EXECUTE );
+	}
 
-	unsigned char* memory = malloc( MAX_MEMORY_SIZE );
-	memset( memory, 0, MAX_MEMORY_SIZE );
+	if ( timer )
+	{
+		DeleteTimerQueueTimer( NULL, timer, INVALID_HANDLE_VALUE );
+	}
 
-	(*function)(getchar, putchar, memory);
+	if ( status == RUN_TAPE_OVERFLOW )
+	{
+		fprintf( stderr, "Ran off the end of the tape.\n" );
+	}
 
 	if ( dump )
 	{
-		dumpMemory( memory );
+		dumpMemory( &tape );
 	}
 
-	free( memory );
+	freeTape( &tape );
+
+	return status;
+}
+
+VOID CALLBACK onTimeout( PVOID fuel, BOOLEAN timerFired )
+{
+	//Next back-edge decrements this to zero and leaves the program.
+	InterlockedExchange64( (volatile LONG64*)fuel, 1 );
 }
 
-void freeMachineCode( void* code )
+int runClient( const char* path, const char* filename, int64_t maxSteps, int* exitCode )
 {
-	VirtualFree( code, 0, MEM_RELEASE );
+	int size;
+	char* source = getSourceText( filename, &size );
+	if ( ! source )
+	{
+		*exitCode = EXIT_FAILURE;
+		return 1;
+	}
+
+	int status;
+	int connected = runRemote( path, source, size, maxSteps, &status );
+	free( source );
+
+	if ( ! connected )
+	{
+		return 0;
+	}
+
+	*exitCode = status == RUN_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+	if ( status == RUN_LIMIT_REACHED )
+	{
+		fprintf( stderr, "Execution limit reached.\n" );
+	}
+	else if ( status == RUN_TAPE_OVERFLOW )
+	{
+		fprintf( stderr, "Ran off the end of the tape.\n" );
+	}
+	else if ( status == SERVER_COMPILE_ERROR )
+	{
+		fprintf( stderr, "Failed to compile on the server.\n" );
+	}
+	else if ( status == SERVER_CONNECTION_LOST )
+	{
+		fprintf( stderr, "Lost the connection to the server.\n" );
+	}
+
+	return 1;
 }
 
-void dumpMemory( unsigned char* memory )
+void dumpMemory( const tape_t* tape )
 {
+	//Cells are numbered from where the program started, growable tapes only
+	//have the pages the program touched committed.
+	const unsigned char* memory = tape->start;
+	int lowCell = (int)((tape->growable ? tape->base + tape->committedLow : tape->base) - memory);
+	int highCell = lowCell + (int)(tape->growable ? tape->committedHigh - tape->committedLow : tape->size);
+
+	int minIndex = 0;
 	int maxIndex = 0;
-	for ( int i = 0; i < MAX_MEMORY_SIZE; i++ )
+	for ( int i = lowCell; i < highCell; i++ )
 	{
 		if ( memory[i] )
-			maxIndex = i;
+		{
+			minIndex = min( minIndex, i );
+			maxIndex = max( maxIndex, i );
+		}
 	}
+	minIndex = (minIndex - 7) / 8;
 	maxIndex /= 8;
 	maxIndex++;
 
 	printf( "\n" );
-	for ( int i = 0; i < maxIndex; i++ )
+	for ( int i = minIndex; i < maxIndex; i++ )
 	{
-		printf( "0x%04x:", i*8);
-		for ( int j = 0; j < 8; j++ )
+		int first = max( lowCell, i*8 );
+		int last = min( highCell, i*8 + 8 );
+
+		printf( "%s0x%04x:", i < 0 ? "-" : "", abs( i*8 ) );
+		for ( int j = i*8; j < i*8 + 8; j++ )
 		{
-			printf( " %02x", memory[i*8+j] );
+			if ( j >= first && j < last )
+				printf( " %02x", memory[j] );
+			else
+				printf( "   " );
 		}
 		printf( " |" );
-		for ( int j = 0; j < 8; j++ )
+		for ( int j = first; j < last; j++ )
 		{
-			if ( isprint( memory[i * 8 + j] ) )
+			if ( isprint( memory[j] ) )
 			{
-				printf( "%c", memory[i * 8 + j] );
+				printf( "%c", memory[j] );
 			}
 			else
 			{
@@ -150,6 +443,28 @@ void dumpMemory( unsigned char* memory )
 	}
 }
 
+void printTapeRange( const tapeRange_t* range )
+{
+	printf( "Tape range: " );
+
+	if ( range->minimum == RANGE_UNBOUNDED_LOW )
+		printf( "unbounded" );
+	else
+		printf( "%lld", (long long)range->minimum );
+
+	printf( " to " );
+
+	if ( range->maximum == RANGE_UNBOUNDED_HIGH )
+		printf( "unbounded" );
+	else
+		printf( "%lld", (long long)range->maximum );
+
+	if ( range->minimum != RANGE_UNBOUNDED_LOW && range->maximum != RANGE_UNBOUNDED_HIGH )
+		printf( " (%lld cells)\n", (long long)(range->maximum - range->minimum + 1) );
+	else
+		printf( " (growable tape)\n" );
+}
+
 void dumpMachineCode( unsigned char* code, int size, const char* filename )
 {
 	char newFilename[100];
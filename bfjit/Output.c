@@ -0,0 +1,185 @@
+#include "extern_data.h"
+#include "Output.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <Windows.h>
+
+#define OUTPUT_BUFFERS 4
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef struct outputBuffer_s
+{
+	unsigned char* data;
+	int size;
+} outputBuffer_t;
+
+//Buffers are filled and written in the same round robin order so the ring needs no indices
+//beyond the two counters.
+static outputBuffer_t s_buffers[OUTPUT_BUFFERS];
+static outputBuffer_t* s_current;
+static volatile LONG s_submitted; //Buffers handed to the writer.
+static volatile LONG s_written; //Buffers the writer has finished with.
+static volatile LONG s_stop;
+static volatile LONG s_failed; //A write failed, everything after it is dropped.
+
+static HANDLE s_freeBuffers; //Semaphore, buffers the executing thread may fill.
+static HANDLE s_fullBuffers; //Semaphore, buffers waiting for the writer.
+static HANDLE s_writtenEvent; //Set by the writer after every buffer.
+static HANDLE s_writer;
+
+static DWORD WINAPI outputWriter( LPVOID parameter );
+static void submitBuffer();
+static void freeOutputWriter();
+
+int startOutputWriter()
+{
+	fflush( stdout );
+
+	for ( int i = 0; i < OUTPUT_BUFFERS; i++ )
+	{
+		s_buffers[i].data = malloc( OUTPUT_BUFFER_SIZE );
+		s_buffers[i].size = 0;
+	}
+	s_current = &s_buffers[0];
+	s_submitted = 0;
+	s_written = 0;
+	s_stop = 0;
+	s_failed = 0;
+
+	s_freeBuffers = CreateSemaphore( NULL, OUTPUT_BUFFERS - 1, OUTPUT_BUFFERS, NULL );
+	s_fullBuffers = CreateSemaphore( NULL, 0, OUTPUT_BUFFERS, NULL );
+	s_writtenEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+	s_writer = NULL;
+
+	int buffersAllocated = 1;
+	for ( int i = 0; i < OUTPUT_BUFFERS; i++ )
+	{
+		buffersAllocated &= s_buffers[i].data != NULL;
+	}
+
+	if ( buffersAllocated && s_freeBuffers && s_fullBuffers && s_writtenEvent )
+	{
+		s_writer = CreateThread( NULL, 0, outputWriter, NULL, 0, NULL );
+	}
+
+	if ( ! s_writer )
+	{
+		freeOutputWriter();
+		return 0;
+	}
+
+	return 1;
+}
+
+int pipelinedPutChar( int c )
+{
+	//Nowhere for it to go.
+	if ( s_failed )
+	{
+		return EOF;
+	}
+
+	s_current->data[s_current->size++] = (unsigned char)c;
+
+	if ( s_current->size == OUTPUT_BUFFER_SIZE )
+	{
+		submitBuffer();
+	}
+
+	return c;
+}
+
+int pipelinedGetChar( void )
+{
+	//Anyone waiting on our input should see everything printed before it, wait for the
+	//writer to drain.
+	if ( s_current->size )
+	{
+		submitBuffer();
+	}
+
+	while ( s_written != s_submitted )
+	{
+		WaitForSingleObject( s_writtenEvent, INFINITE );
+	}
+
+	return getchar();
+}
+
+int stopOutputWriter()
+{
+	if ( s_current->size )
+	{
+		submitBuffer();
+	}
+
+	InterlockedExchange( &s_stop, 1 );
+	ReleaseSemaphore( s_fullBuffers, 1, NULL );
+	WaitForSingleObject( s_writer, INFINITE );
+
+	freeOutputWriter();
+
+	return ! s_failed;
+}
+
+void freeOutputWriter()
+{
+	HANDLE handles[] = { s_writer, s_freeBuffers, s_fullBuffers, s_writtenEvent };
+	for ( int i = 0; i < sizeof( handles ) / sizeof( handles[0] ); i++ )
+	{
+		if ( handles[i] )
+		{
+			CloseHandle( handles[i] );
+		}
+	}
+	s_writer = s_freeBuffers = s_fullBuffers = s_writtenEvent = NULL;
+
+	for ( int i = 0; i < OUTPUT_BUFFERS; i++ )
+	{
+		free( s_buffers[i].data );
+		s_buffers[i].data = NULL;
+	}
+}
+
+void submitBuffer()
+{
+	s_submitted++;
+	ReleaseSemaphore( s_fullBuffers, 1, NULL );
+
+	//Next buffer in the ring, wait for the writer if it is still in use.
+	WaitForSingleObject( s_freeBuffers, INFINITE );
+	s_current = &s_buffers[s_submitted % OUTPUT_BUFFERS];
+	s_current->size = 0;
+}
+
+DWORD WINAPI outputWriter( LPVOID parameter )
+{
+	LONG index = 0;
+
+	for ( ;; )
+	{
+		WaitForSingleObject( s_fullBuffers, INFINITE );
+
+		//Stop is only raised after the last buffer is submitted, so the ring is empty.
+		if ( index == s_submitted && s_stop )
+		{
+			break;
+		}
+
+		//Through the CRT like putchar, so text mode translates newlines the same with or without
+		//the writer. Once a write fails the rest of the output is dropped, but the ring keeps
+		//turning so the program is never left waiting for a free buffer.
+		outputBuffer_t* buffer = &s_buffers[index % OUTPUT_BUFFERS];
+		if ( ! s_failed && (fwrite( buffer->data, 1, buffer->size, stdout ) != (size_t)buffer->size || fflush( stdout ) != 0) )
+		{
+			InterlockedExchange( &s_failed, 1 );
+		}
+
+		index++;
+		InterlockedExchange( &s_written, index );
+		SetEvent( s_writtenEvent );
+		ReleaseSemaphore( s_freeBuffers, 1, NULL );
+	}
+
+	return 0;
+}
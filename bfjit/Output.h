@@ -0,0 +1,13 @@
+#pragma once
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+//Pipelined output: the program fills buffers and a writer thread writes the full ones to
+//stdout, so execution carries on while the consumer catches up.
+extern int startOutputWriter();
+extern int pipelinedPutChar( int c );
+extern int pipelinedGetChar( void );
+//Returns 0 when some of the output could not be written.
+extern int stopOutputWriter();
+
+#endif
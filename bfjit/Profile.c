@@ -0,0 +1,185 @@
+#include "extern_data.h"
+#include "Profile.h"
+#include <stdio.h>
+#include <Windows.h>
+#include <Psapi.h>
+
+//Windows gives user mode no access to the PMU (instructions, cache and TLB misses need a
+//driver or an ETW session), so those are always reported as unavailable. What we do get is
+//wall time, the thread's cycle counter and page faults.
+typedef struct counters_s
+{
+	int64_t wallTicks;
+	uint64_t cycles;
+	int64_t pageFaults;
+} counters_t;
+
+typedef struct phase_s
+{
+	counters_t total;
+	counters_t begin;
+	int used;
+} phase_t;
+
+static const char* s_phaseNames[PHASE_COUNT] = { "compile", "execute" };
+static const char* s_unavailableCounters[] = { "instructions", "branch_misses", "l1i_misses", "l1d_misses", "dtlb_misses" };
+
+static phase_t s_phases[PHASE_COUNT];
+static int s_enabled = 0;
+static int s_cyclesAvailable = 0;
+static int s_pageFaultsAvailable = 0;
+static LARGE_INTEGER s_frequency;
+
+static void readCounters( counters_t* counters );
+static double wallMilliseconds( const phase_t* phase );
+
+void enableProfiling()
+{
+	QueryPerformanceFrequency( &s_frequency );
+
+	//Find out once what this machine gives us, the rest is reported as unavailable.
+	ULONG64 cycles;
+	s_cyclesAvailable = QueryThreadCycleTime( GetCurrentThread(), &cycles ) != 0;
+
+	PROCESS_MEMORY_COUNTERS memoryCounters;
+	s_pageFaultsAvailable = GetProcessMemoryInfo( GetCurrentProcess(), &memoryCounters, sizeof( memoryCounters ) ) != 0;
+
+	s_enabled = 1;
+}
+
+void beginPhase( ProfilePhase phase )
+{
+	if ( s_enabled )
+	{
+		readCounters( &s_phases[phase].begin );
+	}
+}
+
+void endPhase( ProfilePhase phase )
+{
+	if ( ! s_enabled )
+	{
+		return;
+	}
+
+	counters_t end;
+	readCounters( &end );
+
+	phase_t* current = &s_phases[phase];
+	current->total.wallTicks += end.wallTicks - current->begin.wallTicks;
+	current->total.cycles += end.cycles - current->begin.cycles;
+	current->total.pageFaults += end.pageFaults - current->begin.pageFaults;
+	current->used = 1;
+}
+
+void printProfile()
+{
+	if ( ! s_enabled )
+	{
+		return;
+	}
+
+	//Program output first, it is still sitting in stdout's buffer.
+	fflush( stdout );
+
+	fprintf( stderr, "\n%-8s %12s %16s %12s\n", "phase", "wall (ms)", "cycles", "page faults" );
+	for ( int i = 0; i < PHASE_COUNT; i++ )
+	{
+		if ( ! s_phases[i].used )
+		{
+			continue;
+		}
+
+		fprintf( stderr, "%-8s %12.3f ", s_phaseNames[i], wallMilliseconds( &s_phases[i] ) );
+
+		if ( s_cyclesAvailable )
+			fprintf( stderr, "%16llu ", (unsigned long long)s_phases[i].total.cycles );
+		else
+			fprintf( stderr, "%16s ", "n/a" );
+
+		if ( s_pageFaultsAvailable )
+			fprintf( stderr, "%12lld\n", (long long)s_phases[i].total.pageFaults );
+		else
+			fprintf( stderr, "%12s\n", "n/a" );
+	}
+
+	fprintf( stderr, "Instructions, branch, L1i/L1d and dTLB misses: unavailable without PMU access.\n" );
+}
+
+int writeProfileJson( const char* filename )
+{
+	if ( ! s_enabled )
+	{
+		return 0;
+	}
+
+	FILE* file = NULL;
+	fopen_s( &file, filename, "w" );
+	if ( ! file )
+	{
+		return 0;
+	}
+
+	fprintf( file, "{\n" );
+	int first = 1;
+	for ( int i = 0; i < PHASE_COUNT; i++ )
+	{
+		if ( ! s_phases[i].used )
+		{
+			continue;
+		}
+
+		fprintf( file, "%s\t\"%s\": {\n", first ? "" : ",\n", s_phaseNames[i] );
+		fprintf( file, "\t\t\"wall_ms\": %.3f,\n", wallMilliseconds( &s_phases[i] ) );
+
+		if ( s_cyclesAvailable )
+			fprintf( file, "\t\t\"cycles\": %llu,\n", (unsigned long long)s_phases[i].total.cycles );
+		else
+			fprintf( file, "\t\t\"cycles\": null,\n" );
+
+		if ( s_pageFaultsAvailable )
+			fprintf( file, "\t\t\"page_faults\": %lld", (long long)s_phases[i].total.pageFaults );
+		else
+			fprintf( file, "\t\t\"page_faults\": null" );
+
+		//Keep the keys so consumers don't have to care which platform produced the file.
+		for ( int j = 0; j < sizeof( s_unavailableCounters ) / sizeof( s_unavailableCounters[0] ); j++ )
+		{
+			fprintf( file, ",\n\t\t\"%s\": null", s_unavailableCounters[j] );
+		}
+
+		fprintf( file, "\n\t}" );
+		first = 0;
+	}
+	fprintf( file, "\n}\n" );
+
+	fclose( file );
+
+	return 1;
+}
+
+void readCounters( counters_t* counters )
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter( &now );
+	counters->wallTicks = now.QuadPart;
+
+	ULONG64 cycles = 0;
+	if ( s_cyclesAvailable )
+	{
+		QueryThreadCycleTime( GetCurrentThread(), &cycles );
+	}
+	counters->cycles = cycles;
+
+	PROCESS_MEMORY_COUNTERS memoryCounters;
+	counters->pageFaults = 0;
+	if ( s_pageFaultsAvailable && GetProcessMemoryInfo( GetCurrentProcess(), &memoryCounters, sizeof( memoryCounters ) ) )
+	{
+		counters->pageFaults = memoryCounters.PageFaultCount;
+	}
+}
+
+double wallMilliseconds( const phase_t* phase )
+{
+	return (double)phase->total.wallTicks * 1000.0 / (double)s_frequency.QuadPart;
+}
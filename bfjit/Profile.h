@@ -0,0 +1,20 @@
+#pragma once
+#ifndef PROFILE_H
+#define PROFILE_H
+
+typedef enum ProfilePhase
+{
+	PHASE_COMPILE, //Compile, partial evaluation, analysis and assembly.
+	PHASE_EXECUTE, //The call into the generated code.
+	PHASE_COUNT
+} ProfilePhase;
+
+//Counters are only read once profiling is enabled, phases accumulate over every begin/end pair.
+extern void enableProfiling();
+extern void beginPhase( ProfilePhase phase );
+extern void endPhase( ProfilePhase phase );
+
+extern void printProfile();
+extern int writeProfileJson( const char* filename );
+
+#endif
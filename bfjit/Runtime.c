@@ -0,0 +1,321 @@
+#include "extern_data.h"
+#include "Runtime.h"
+#include "Assemble.h"
+#include <memory.h>
+#include <stdlib.h>
+#include <Windows.h>
+
+#define TAPE_RESERVE_SIZE ((size_t)1 << 30)
+#define TAPE_COMMIT_SIZE ((size_t)1 << 16)
+#define MAX_GROWABLE_TAPES 64
+
+//Generated code only reaches a cell through the pointer plus a 32 bit displacement, and the
+//pointer itself never moves more than that past the last cell it touched. Growable tapes keep
+//this much reserved but never committed on both sides, so running off an end always faults.
+#define TAPE_FAULT_MARGIN ((size_t)1 << 32)
+
+static tape_t* volatile s_growableTapes[MAX_GROWABLE_TAPES];
+
+//Where the code running on this thread leaves when its tape cannot grow, NULL outside runMachineCode.
+static __declspec(thread) unsigned char* s_tapeOverflowExit;
+//The growable tape that code runs on, the only one its faults may commit in. NULL for bounded tapes.
+static __declspec(thread) tape_t* s_tape;
+
+static int enableLockMemoryPrivilege();
+static LONG CALLBACK onTapeFault( PEXCEPTION_POINTERS exception );
+static int commitTape( tape_t* tape, size_t offset );
+static tape_t* findGrowableTape( const unsigned char* memory );
+
+void* allocatePages( size_t size, int flags, int* largePages )
+{
+	DWORD protection = (flags & PAGES_EXECUTABLE) ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE;
+	void* memory = NULL;
+
+	if ( flags & PAGES_LARGE )
+	{
+		//Large pages need SeLockMemoryPrivilege and a size rounded up to the large page.
+		static int s_privilegeEnabled = -1;
+		if ( s_privilegeEnabled < 0 )
+		{
+			s_privilegeEnabled = enableLockMemoryPrivilege();
+		}
+
+		SIZE_T largePageSize = GetLargePageMinimum();
+		if ( s_privilegeEnabled && largePageSize )
+		{
+			SIZE_T largeSize = (size + largePageSize - 1) & ~(largePageSize - 1);
+			memory = VirtualAlloc( NULL, largeSize, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, protection );
+		}
+	}
+
+	if ( largePages )
+	{
+		*largePages = memory != NULL;
+	}
+
+	if ( ! memory )
+	{
+		//Normal pages, either asked for or the large page allocation failed. Executable
+		//memory starts writable, prepareMachineCode flips it once the code is copied in.
+		memory = VirtualAlloc( NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
+	}
+
+	return memory;
+}
+
+void freePages( void* memory )
+{
+	VirtualFree( memory, 0, MEM_RELEASE );
+}
+
+int allocateTape( tape_t* tape, const tapeRange_t* range, int flags )
+{
+	memset( tape, 0, sizeof( tape_t ) );
+
+	int bounded = range->minimum != RANGE_UNBOUNDED_LOW && range->maximum != RANGE_UNBOUNDED_HIGH;
+	if ( bounded && (uint64_t)(range->maximum - range->minimum) < TAPE_RESERVE_SIZE )
+	{
+		tape->size = (size_t)(range->maximum - range->minimum + 1);
+		tape->base = allocatePages( tape->size, flags, &tape->largePages );
+		if ( ! tape->base )
+		{
+			return 0;
+		}
+
+		tape->start = tape->base - range->minimum;
+		return 1;
+	}
+
+	//Only reserve, the fault handler commits pages as the pointer wanders into them.
+	static int s_handlerInstalled = 0;
+	if ( ! s_handlerInstalled )
+	{
+		AddVectoredExceptionHandler( 1, onTapeFault );
+		s_handlerInstalled = 1;
+	}
+
+	tape->size = TAPE_RESERVE_SIZE;
+	tape->reservation = VirtualAlloc( NULL, TAPE_FAULT_MARGIN + tape->size + TAPE_FAULT_MARGIN, MEM_RESERVE, PAGE_NOACCESS );
+	if ( ! tape->reservation )
+	{
+		return 0;
+	}
+	tape->base = tape->reservation + TAPE_FAULT_MARGIN;
+
+	//Start as far from the unbounded end(s) as the bounded one allows.
+	size_t startOffset = tape->size / 2;
+	if ( range->minimum != RANGE_UNBOUNDED_LOW && range->minimum > -(int64_t)startOffset )
+	{
+		startOffset = (size_t)-range->minimum;
+	}
+	else if ( range->maximum != RANGE_UNBOUNDED_HIGH && range->maximum < (int64_t)startOffset )
+	{
+		startOffset = tape->size - 1 - (size_t)range->maximum;
+	}
+
+	tape->start = tape->base + startOffset;
+	tape->growable = 1;
+	tape->committedLow = startOffset & ~(TAPE_COMMIT_SIZE - 1);
+	tape->committedHigh = tape->committedLow;
+
+	int slot;
+	for ( slot = 0; slot < MAX_GROWABLE_TAPES; slot++ )
+	{
+		if ( InterlockedCompareExchangePointer( (PVOID volatile*)&s_growableTapes[slot], tape, NULL ) == NULL )
+		{
+			break;
+		}
+	}
+
+	if ( slot == MAX_GROWABLE_TAPES || ! commitTape( tape, startOffset ) )
+	{
+		freeTape( tape );
+		return 0;
+	}
+
+	return 1;
+}
+
+void freeTape( tape_t* tape )
+{
+	if ( tape->growable )
+	{
+		for ( int slot = 0; slot < MAX_GROWABLE_TAPES; slot++ )
+		{
+			InterlockedCompareExchangePointer( (PVOID volatile*)&s_growableTapes[slot], NULL, tape );
+		}
+		VirtualFree( tape->reservation, 0, MEM_RELEASE );
+	}
+	else if ( tape->base )
+	{
+		freePages( tape->base );
+	}
+
+	tape->base = NULL;
+}
+
+void resetTape( tape_t* tape )
+{
+	if ( ! tape->growable )
+	{
+		memset( tape->base, 0, tape->size );
+		return;
+	}
+
+	//Decommitted pages come back zeroed, and whatever a large run committed is returned.
+	VirtualFree( tape->base + tape->committedLow, tape->committedHigh - tape->committedLow, MEM_DECOMMIT );
+
+	size_t startOffset = tape->start - tape->base;
+	tape->committedLow = startOffset & ~(TAPE_COMMIT_SIZE - 1);
+	tape->committedHigh = tape->committedLow;
+
+	//Failing here only means the first access faults and commits it.
+	commitTape( tape, startOffset );
+}
+
+void* prepareMachineCode( void* code, int size, int flags, int* largePages )
+{
+	int gotLargePages;
+	void* executableMemory = allocatePages( size, flags | PAGES_EXECUTABLE, &gotLargePages );
+	if ( largePages )
+	{
+		*largePages = gotLargePages;
+	}
+
+	if ( ! executableMemory )
+	{
+		return NULL;
+	}
+
+	memcpy_s( executableMemory, size, code, size );
+
+	if ( gotLargePages )
+	{
+		//Large page mappings are left read/write/execute, changing their protection is not supported.
+		return executableMemory;
+	}
+
+	DWORD oldProtection;
+	if ( VirtualProtect( executableMemory, size, PAGE_EXECUTE_READ, &oldProtection ) )
+	{
+		return executableMemory;
+	}
+	else
+	{
+		freeMachineCode( executableMemory );
+		return NULL;
+	}
+}
+
+RunStatus runMachineCode( void* code, getChar_t getChar, putChar_t putChar, unsigned char* memory, volatile int64_t* fuel )
+{
+	RunStatus (*function)(getChar_t, putChar_t, unsigned char*, volatile int64_t*);
+
+	function = code;
+
+	s_tape = findGrowableTape( memory );
+	s_tapeOverflowExit = (unsigned char*)code + getTapeOverflowExit();
+	RunStatus status = (*function)(getChar, putChar, memory, fuel);
+	s_tapeOverflowExit = NULL;
+	s_tape = NULL;
+
+	return status;
+}
+
+void freeMachineCode( void* code )
+{
+	freePages( code );
+}
+
+int enableLockMemoryPrivilege()
+{
+	HANDLE token;
+	if ( ! OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token ) )
+	{
+		return 0;
+	}
+
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+	int enabled = 0;
+	if ( LookupPrivilegeValue( NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid ) )
+	{
+		//Succeeds even when the account does not hold the privilege, the last error says which.
+		enabled = AdjustTokenPrivileges( token, FALSE, &privileges, 0, NULL, NULL ) && GetLastError() == ERROR_SUCCESS;
+	}
+
+	CloseHandle( token );
+
+	return enabled;
+}
+
+LONG CALLBACK onTapeFault( PEXCEPTION_POINTERS exception )
+{
+	if ( exception->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION )
+	{
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	//Only this thread's own tape, a stray access into another worker's must not write to it.
+	tape_t* tape = s_tape;
+	if ( ! tape || ! s_tapeOverflowExit )
+	{
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+
+	uintptr_t address = (uintptr_t)exception->ExceptionRecord->ExceptionInformation[1];
+	if ( address >= (uintptr_t)tape->base && address < (uintptr_t)tape->base + tape->size
+		&& commitTape( tape, address - (uintptr_t)tape->base ) )
+	{
+		return EXCEPTION_CONTINUE_EXECUTION;
+	}
+
+	if ( address >= (uintptr_t)tape->reservation && address < (uintptr_t)tape->base + tape->size + TAPE_FAULT_MARGIN )
+	{
+		//Off the ends or over the commit limit. Rather than take the process down, and with it
+		//a server's other clients, leave through the exit assemble() put in the code.
+		exception->ContextRecord->Rip = (DWORD64)s_tapeOverflowExit;
+		return EXCEPTION_CONTINUE_EXECUTION;
+	}
+
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+tape_t* findGrowableTape( const unsigned char* memory )
+{
+	for ( int slot = 0; slot < MAX_GROWABLE_TAPES; slot++ )
+	{
+		tape_t* tape = s_growableTapes[slot];
+		if ( tape && memory >= tape->base && memory < tape->base + tape->size )
+		{
+			return tape;
+		}
+	}
+	return NULL;
+}
+
+int commitTape( tape_t* tape, size_t offset )
+{
+	size_t page = offset & ~(TAPE_COMMIT_SIZE - 1);
+
+	size_t low = min( page, tape->committedLow );
+	size_t high = max( page + TAPE_COMMIT_SIZE, tape->committedHigh );
+	if ( tape->commitLimit && high - low > tape->commitLimit )
+	{
+		return 0;
+	}
+
+	//The whole span, so everything between committedLow and committedHigh really is committed
+	//and resetTape, the dump and the limit all see the same pages. Untouched pages take no physical memory.
+	if ( ! VirtualAlloc( tape->base + low, high - low, MEM_COMMIT, PAGE_READWRITE ) )
+	{
+		return 0;
+	}
+
+	tape->committedLow = low;
+	tape->committedHigh = high;
+
+	return 1;
+}
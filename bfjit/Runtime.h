@@ -0,0 +1,43 @@
+#pragma once
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+typedef int (*getChar_t)( void );
+typedef int (*putChar_t)( int );
+
+typedef enum PageFlags
+{
+	PAGES_EXECUTABLE = 1 << 0, //Only large pages are mapped executable here, see prepareMachineCode.
+	PAGES_LARGE = 1 << 1 //Try large (2 MB) pages, falls back to normal pages.
+} PageFlags;
+
+//Zeroed, page aligned memory. largePages (optional) reports whether large pages were obtained.
+extern void* allocatePages( size_t size, int flags, int* largePages );
+extern void freePages( void* memory );
+
+typedef struct tape_s
+{
+	unsigned char* base; //Start of the allocation, or of the usable part of a growable tape's reservation.
+	size_t size; //Bytes usable from base.
+	unsigned char* reservation; //Growable tapes only, base with an uncommitted guard on either side.
+	unsigned char* start; //Cell the program starts on.
+	int growable; //Reserved rather than committed, pages get committed as the program touches them.
+	int largePages;
+	volatile size_t committedLow; //Committed span from base, only meaningful for growable tapes.
+	volatile size_t committedHigh;
+	size_t commitLimit; //Most bytes a growable tape may commit, 0 for the whole reservation.
+} tape_t;
+
+//Exactly the analysed range when it is bounded, otherwise a large reservation that grows on demand
+//and faults cleanly past its ends instead of running into whatever memory follows.
+extern int allocateTape( tape_t* tape, const tapeRange_t* range, int flags );
+extern void freeTape( tape_t* tape );
+//Zero the tape for the next program, growable tapes give back all but the page the program starts on.
+extern void resetTape( tape_t* tape );
+
+extern void* prepareMachineCode( void* code, int size, int flags, int* largePages );
+//A growable tape the program runs off, or grows past its commit limit, ends it with RUN_TAPE_OVERFLOW.
+extern RunStatus runMachineCode( void* code, getChar_t getChar, putChar_t putChar, unsigned char* memory, volatile int64_t* fuel );
+extern void freeMachineCode( void* code );
+
+#endif
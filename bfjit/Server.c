@@ -0,0 +1,752 @@
+#include "extern_data.h"
+#include "Assemble.h"
+#include "Compile.h"
+#include "Runtime.h"
+#include "Server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <winsock2.h>
+#include <afunix.h>
+#include <Windows.h>
+
+#define SERVER_PROTOCOL_VERSION 1
+#define SERVER_BUFFER_SIZE (16 * 1024)
+#define SERVER_MAX_SOURCE (16 * 1024 * 1024)
+#define SERVER_CACHE_ENTRIES 64
+#define SERVER_QUEUE_SIZE 64
+#define SERVER_MAX_WORKERS 64
+#define SERVER_MAX_TAPE ((size_t)256 * 1024 * 1024) //Committed tape bytes a request may use.
+#define SERVER_WATCH_INTERVAL 100 //Milliseconds between checks on running requests.
+
+//A request is this header and the source, followed by input frames from the client while the
+//program runs. The server answers with output frames and a single status frame.
+typedef struct requestHeader_s
+{
+	uint32_t version;
+	uint32_t sourceSize;
+	int64_t maxSteps; //0 for no limit.
+} requestHeader_t;
+
+typedef enum FrameType
+{
+	FRAME_INPUT, //Client to server, an empty frame is end of input.
+	FRAME_OUTPUT,
+	FRAME_STATUS, //int32_t, a RunStatus or one of the SERVER_ statuses.
+	FRAME_PING //Empty, sent while a program runs so a client that went away is noticed. Clients ignore it.
+} FrameType;
+
+typedef struct frameHeader_s
+{
+	uint32_t type;
+	uint32_t size;
+} frameHeader_t;
+
+typedef struct cacheEntry_s
+{
+	uint64_t hash;
+	char* source;
+	int sourceSize;
+	void* code;
+	int references; //Runs using the code, only unreferenced entries are evicted.
+	struct cacheEntry_s* previous; //Towards the most recently used.
+	struct cacheEntry_s* next;
+} cacheEntry_t;
+
+typedef struct worker_s
+{
+	HANDLE thread;
+	tape_t tape;
+	volatile int64_t fuel;
+	SOCKET client;
+	CRITICAL_SECTION watchLock; //Held by the watchdog while it looks at a request, so it never stops the next one.
+	CRITICAL_SECTION sendLock; //Frames from the worker and the watchdog's pings share the connection.
+	int running;
+	ULONGLONG deadline; //Tick count the request has to finish by, 0 for none.
+	int connected;
+	int inputEnd;
+	int inputIndex;
+	int inputSize;
+	int outputSize;
+	unsigned char input[SERVER_BUFFER_SIZE];
+	unsigned char output[SERVER_BUFFER_SIZE];
+} worker_t;
+
+//Generated code calls getChar and putChar without context, each worker finds its own.
+static __declspec(thread) worker_t* s_worker;
+
+static CRITICAL_SECTION s_cacheLock;
+static CRITICAL_SECTION s_compileLock; //The compiler and assembler keep static tables.
+static cacheEntry_t* s_cacheFirst;
+static cacheEntry_t* s_cacheLast;
+static int s_cacheCount;
+
+static CRITICAL_SECTION s_queueLock;
+static SOCKET s_queue[SERVER_QUEUE_SIZE];
+static int s_queueRead;
+static int s_queueWrite;
+static HANDLE s_queuedClients; //Semaphore, accepted connections waiting for a worker.
+static HANDLE s_freeSlots; //Semaphore, room left in the queue.
+
+static worker_t* s_workers[SERVER_MAX_WORKERS];
+static int s_workersCount;
+static DWORD s_timeoutMs; //Wall-clock budget per request, 0 for none.
+
+//Client side, held by the input thread while it sends so runRemote can stop it before closing the socket.
+static CRITICAL_SECTION s_inputLock;
+static volatile LONG s_inputStopped;
+
+static int startWinsock();
+static int sendAll( SOCKET connection, const void* data, int size );
+static int receiveAll( SOCKET connection, void* data, int size );
+static int sendFrame( SOCKET connection, FrameType type, const void* data, int size );
+
+static DWORD WINAPI serverWorker( LPVOID parameter );
+static DWORD WINAPI serverWatchdog( LPVOID parameter );
+static int pingClient( worker_t* worker );
+static int sendWorkerFrame( worker_t* worker, FrameType type, const void* data, int size );
+static void serveClient( worker_t* worker );
+static int serverGetChar( void );
+static int serverPutChar( int c );
+static void flushOutput( worker_t* worker );
+static void disconnect( worker_t* worker );
+
+static cacheEntry_t* acquireCode( const char* source, int sourceSize );
+static void releaseCode( cacheEntry_t* entry );
+static cacheEntry_t* findEntry( uint64_t hash, const char* source, int sourceSize );
+static void moveToFront( cacheEntry_t* entry );
+static void evictEntries();
+static void* compileCode( const char* source );
+static uint64_t hashSource( const char* source, int size );
+
+static DWORD WINAPI clientInput( LPVOID parameter );
+static int sendInput( SOCKET server, const void* data, int size );
+
+int serve( const char* path, int workers, uint32_t timeoutMs )
+{
+	if ( ! startWinsock() )
+	{
+		fprintf( stderr, "Failed to start Winsock.\n" );
+		return 0;
+	}
+
+	SOCKADDR_UN address;
+	memset( &address, 0, sizeof( address ) );
+	address.sun_family = AF_UNIX;
+	if ( strlen( path ) >= sizeof( address.sun_path ) )
+	{
+		fprintf( stderr, "Socket path too long: %s\n", path );
+		return 0;
+	}
+	strcpy_s( address.sun_path, sizeof( address.sun_path ), path );
+
+	//A server that went away leaves its socket file behind and bind fails on it.
+	DeleteFileA( path );
+
+	SOCKET listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if ( listener == INVALID_SOCKET
+		|| bind( listener, (struct sockaddr*)&address, sizeof( address ) ) == SOCKET_ERROR
+		|| listen( listener, SOMAXCONN ) == SOCKET_ERROR )
+	{
+		fprintf( stderr, "Failed to listen on %s\n", path );
+		return 0;
+	}
+
+	if ( workers <= 0 )
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo( &info );
+		workers = info.dwNumberOfProcessors;
+	}
+	workers = min( workers, SERVER_MAX_WORKERS );
+
+	InitializeCriticalSection( &s_cacheLock );
+	InitializeCriticalSection( &s_compileLock );
+	InitializeCriticalSection( &s_queueLock );
+	s_queuedClients = CreateSemaphore( NULL, 0, SERVER_QUEUE_SIZE, NULL );
+	s_freeSlots = CreateSemaphore( NULL, SERVER_QUEUE_SIZE, SERVER_QUEUE_SIZE, NULL );
+
+	//Programs can go anywhere, every worker gets a growable tape for its lifetime.
+	tapeRange_t range;
+	range.minimum = RANGE_UNBOUNDED_LOW;
+	range.maximum = RANGE_UNBOUNDED_HIGH;
+
+	int started = 0;
+	for ( int i = 0; i < workers; i++ )
+	{
+		worker_t* worker = calloc( 1, sizeof( worker_t ) );
+		if ( ! worker || ! allocateTape( &worker->tape, &range, 0 ) )
+		{
+			free( worker );
+			break;
+		}
+		worker->tape.commitLimit = SERVER_MAX_TAPE;
+		InitializeCriticalSection( &worker->watchLock );
+		InitializeCriticalSection( &worker->sendLock );
+
+		worker->thread = CreateThread( NULL, 0, serverWorker, worker, 0, NULL );
+		if ( worker->thread )
+		{
+			s_workers[started++] = worker;
+		}
+	}
+
+	if ( started == 0 )
+	{
+		fprintf( stderr, "Failed to start server workers.\n" );
+		return 0;
+	}
+
+	//Programs that never read or write would not notice their client leave on their own.
+	s_workersCount = started;
+	s_timeoutMs = timeoutMs;
+	CreateThread( NULL, 0, serverWatchdog, NULL, 0, NULL );
+
+	fprintf( stderr, "Serving on %s with %d workers.\n", path, started );
+
+	for ( ;; )
+	{
+		WaitForSingleObject( s_freeSlots, INFINITE );
+
+		SOCKET client = accept( listener, NULL, NULL );
+		if ( client == INVALID_SOCKET )
+		{
+			ReleaseSemaphore( s_freeSlots, 1, NULL );
+			continue;
+		}
+
+		EnterCriticalSection( &s_queueLock );
+		s_queue[s_queueWrite++ % SERVER_QUEUE_SIZE] = client;
+		LeaveCriticalSection( &s_queueLock );
+		ReleaseSemaphore( s_queuedClients, 1, NULL );
+	}
+}
+
+int runRemote( const char* path, const char* source, int sourceSize, int64_t maxSteps, int* status )
+{
+	if ( ! startWinsock() )
+	{
+		return 0;
+	}
+
+	SOCKADDR_UN address;
+	memset( &address, 0, sizeof( address ) );
+	address.sun_family = AF_UNIX;
+	if ( strlen( path ) >= sizeof( address.sun_path ) )
+	{
+		return 0;
+	}
+	strcpy_s( address.sun_path, sizeof( address.sun_path ), path );
+
+	SOCKET server = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if ( server == INVALID_SOCKET )
+	{
+		return 0;
+	}
+	if ( connect( server, (struct sockaddr*)&address, sizeof( address ) ) == SOCKET_ERROR )
+	{
+		closesocket( server );
+		return 0;
+	}
+
+	*status = SERVER_CONNECTION_LOST;
+
+	requestHeader_t header;
+	header.version = SERVER_PROTOCOL_VERSION;
+	header.sourceSize = sourceSize;
+	header.maxSteps = maxSteps;
+	if ( ! sendAll( server, &header, sizeof( header ) ) || ! sendAll( server, source, sourceSize ) )
+	{
+		closesocket( server );
+		return 1;
+	}
+
+	//Input is forwarded as it arrives so interactive programs behave as they would locally.
+	InitializeCriticalSection( &s_inputLock );
+	s_inputStopped = 0;
+	HANDLE inputThread = CreateThread( NULL, 0, clientInput, (LPVOID)server, 0, NULL );
+
+	char* buffer = malloc( SERVER_BUFFER_SIZE );
+	frameHeader_t frame;
+	while ( buffer && receiveAll( server, &frame, sizeof( frame ) ) && frame.size <= SERVER_BUFFER_SIZE )
+	{
+		if ( ! receiveAll( server, buffer, frame.size ) )
+		{
+			break;
+		}
+
+		if ( frame.type == FRAME_OUTPUT )
+		{
+			fwrite( buffer, 1, frame.size, stdout );
+			fflush( stdout );
+		}
+		else if ( frame.type == FRAME_STATUS && frame.size == sizeof( int32_t ) )
+		{
+			int32_t result;
+			memcpy_s( &result, sizeof( result ), buffer, sizeof( result ) );
+			*status = result;
+			break;
+		}
+	}
+
+	free( buffer );
+
+	//The input thread may still be blocked on stdin when the program did not read all of it.
+	//Stop it before the socket goes, or it would later send on a handle Winsock may have reused.
+	shutdown( server, SD_SEND );
+	EnterCriticalSection( &s_inputLock );
+	InterlockedExchange( &s_inputStopped, 1 );
+	LeaveCriticalSection( &s_inputLock );
+	if ( inputThread )
+	{
+		CancelSynchronousIo( inputThread );
+		CloseHandle( inputThread );
+	}
+	closesocket( server );
+
+	return 1;
+}
+
+int startWinsock()
+{
+	WSADATA data;
+	return WSAStartup( MAKEWORD( 2, 2 ), &data ) == 0;
+}
+
+int sendAll( SOCKET connection, const void* data, int size )
+{
+	const char* bytes = data;
+	while ( size > 0 )
+	{
+		int sent = send( connection, bytes, size, 0 );
+		if ( sent <= 0 )
+		{
+			return 0;
+		}
+		bytes += sent;
+		size -= sent;
+	}
+
+	return 1;
+}
+
+int receiveAll( SOCKET connection, void* data, int size )
+{
+	char* bytes = data;
+	while ( size > 0 )
+	{
+		int received = recv( connection, bytes, size, 0 );
+		if ( received <= 0 )
+		{
+			return 0;
+		}
+		bytes += received;
+		size -= received;
+	}
+
+	return 1;
+}
+
+int sendFrame( SOCKET connection, FrameType type, const void* data, int size )
+{
+	frameHeader_t frame;
+	frame.type = type;
+	frame.size = size;
+
+	return sendAll( connection, &frame, sizeof( frame ) ) && sendAll( connection, data, size );
+}
+
+DWORD WINAPI serverWorker( LPVOID parameter )
+{
+	worker_t* worker = parameter;
+	s_worker = worker;
+
+	for ( ;; )
+	{
+		WaitForSingleObject( s_queuedClients, INFINITE );
+
+		EnterCriticalSection( &s_queueLock );
+		worker->client = s_queue[s_queueRead++ % SERVER_QUEUE_SIZE];
+		LeaveCriticalSection( &s_queueLock );
+		ReleaseSemaphore( s_freeSlots, 1, NULL );
+
+		serveClient( worker );
+		closesocket( worker->client );
+	}
+
+	return 0;
+}
+
+DWORD WINAPI serverWatchdog( LPVOID parameter )
+{
+	for ( ;; )
+	{
+		Sleep( SERVER_WATCH_INTERVAL );
+
+		for ( int i = 0; i < s_workersCount; i++ )
+		{
+			worker_t* worker = s_workers[i];
+
+			//Out of time or nobody left to answer, stop the program at its next back-edge.
+			EnterCriticalSection( &worker->watchLock );
+			if ( worker->running && ((worker->deadline && GetTickCount64() >= worker->deadline) || ! pingClient( worker )) )
+			{
+				InterlockedExchange64( (volatile LONG64*)&worker->fuel, 1 );
+			}
+			LeaveCriticalSection( &worker->watchLock );
+		}
+	}
+
+	return 0;
+}
+
+int pingClient( worker_t* worker )
+{
+	//A worker busy sending finds out for itself, and a client not reading has a full buffer
+	//the watchdog must not block on.
+	if ( ! TryEnterCriticalSection( &worker->sendLock ) )
+	{
+		return 1;
+	}
+
+	fd_set writable;
+	FD_ZERO( &writable );
+	FD_SET( worker->client, &writable );
+
+	TIMEVAL poll = { 0, 0 };
+	int alive = select( 0, NULL, &writable, NULL, &poll ) <= 0 || sendFrame( worker->client, FRAME_PING, NULL, 0 );
+
+	LeaveCriticalSection( &worker->sendLock );
+
+	return alive;
+}
+
+int sendWorkerFrame( worker_t* worker, FrameType type, const void* data, int size )
+{
+	EnterCriticalSection( &worker->sendLock );
+	int sent = sendFrame( worker->client, type, data, size );
+	LeaveCriticalSection( &worker->sendLock );
+
+	return sent;
+}
+
+void serveClient( worker_t* worker )
+{
+	requestHeader_t header;
+	if ( ! receiveAll( worker->client, &header, sizeof( header ) )
+		|| header.version != SERVER_PROTOCOL_VERSION
+		|| header.sourceSize > SERVER_MAX_SOURCE )
+	{
+		return;
+	}
+
+	char* source = malloc( header.sourceSize + 1 );
+	if ( ! source )
+	{
+		return;
+	}
+	if ( ! receiveAll( worker->client, source, header.sourceSize ) )
+	{
+		free( source );
+		return;
+	}
+	source[header.sourceSize] = 0;
+
+	cacheEntry_t* entry = acquireCode( source, header.sourceSize );
+	free( source );
+
+	int32_t status = SERVER_COMPILE_ERROR;
+	if ( entry )
+	{
+		worker->connected = 1;
+		worker->inputEnd = 0;
+		worker->inputIndex = 0;
+		worker->inputSize = 0;
+		worker->outputSize = 0;
+
+		EnterCriticalSection( &worker->watchLock );
+		worker->fuel = header.maxSteps > 0 ? header.maxSteps : INT64_MAX;
+		worker->deadline = s_timeoutMs ? GetTickCount64() + s_timeoutMs : 0;
+		worker->running = 1;
+		LeaveCriticalSection( &worker->watchLock );
+
+		status = runMachineCode( entry->code, serverGetChar, serverPutChar, worker->tape.start, &worker->fuel );
+
+		EnterCriticalSection( &worker->watchLock );
+		worker->running = 0;
+		LeaveCriticalSection( &worker->watchLock );
+
+		flushOutput( worker );
+		releaseCode( entry );
+
+		//Leave the tape as the next program expects to find it, and give back what this one grew it to.
+		resetTape( &worker->tape );
+	}
+
+	sendWorkerFrame( worker, FRAME_STATUS, &status, sizeof( status ) );
+}
+
+int serverGetChar( void )
+{
+	worker_t* worker = s_worker;
+
+	if ( worker->inputIndex == worker->inputSize )
+	{
+		//The client may be waiting on our output before it sends more input.
+		flushOutput( worker );
+
+		frameHeader_t frame;
+		while ( ! worker->inputEnd && worker->inputIndex == worker->inputSize )
+		{
+			if ( ! receiveAll( worker->client, &frame, sizeof( frame ) )
+				|| frame.type != FRAME_INPUT
+				|| frame.size > SERVER_BUFFER_SIZE
+				|| ! receiveAll( worker->client, worker->input, frame.size ) )
+			{
+				disconnect( worker );
+				break;
+			}
+
+			worker->inputEnd = frame.size == 0;
+			worker->inputIndex = 0;
+			worker->inputSize = frame.size;
+		}
+
+		if ( worker->inputIndex == worker->inputSize )
+		{
+			return EOF;
+		}
+	}
+
+	return worker->input[worker->inputIndex++];
+}
+
+int serverPutChar( int c )
+{
+	worker_t* worker = s_worker;
+
+	worker->output[worker->outputSize++] = (unsigned char)c;
+	if ( worker->outputSize == SERVER_BUFFER_SIZE )
+	{
+		flushOutput( worker );
+	}
+
+	return c;
+}
+
+void flushOutput( worker_t* worker )
+{
+	if ( worker->outputSize && worker->connected )
+	{
+		if ( ! sendWorkerFrame( worker, FRAME_OUTPUT, worker->output, worker->outputSize ) )
+		{
+			disconnect( worker );
+		}
+	}
+
+	worker->outputSize = 0;
+}
+
+void disconnect( worker_t* worker )
+{
+	//Nobody is left to read the output, stop the program at its next back-edge like a timeout does.
+	worker->connected = 0;
+	worker->inputEnd = 1;
+	InterlockedExchange64( (volatile LONG64*)&worker->fuel, 1 );
+}
+
+cacheEntry_t* acquireCode( const char* source, int sourceSize )
+{
+	uint64_t hash = hashSource( source, sourceSize );
+
+	EnterCriticalSection( &s_cacheLock );
+	cacheEntry_t* entry = findEntry( hash, source, sourceSize );
+	LeaveCriticalSection( &s_cacheLock );
+
+	if ( entry )
+	{
+		return entry;
+	}
+
+	//Another worker may have compiled the same source while we waited for the compiler.
+	EnterCriticalSection( &s_compileLock );
+
+	EnterCriticalSection( &s_cacheLock );
+	entry = findEntry( hash, source, sourceSize );
+	LeaveCriticalSection( &s_cacheLock );
+
+	if ( ! entry )
+	{
+		void* code = compileCode( source );
+		if ( code )
+		{
+			entry = calloc( 1, sizeof( cacheEntry_t ) );
+			char* copy = malloc( sourceSize );
+			if ( ! entry || ! copy )
+			{
+				free( entry );
+				free( copy );
+				freeMachineCode( code );
+				LeaveCriticalSection( &s_compileLock );
+				return NULL;
+			}
+
+			entry->hash = hash;
+			entry->source = copy;
+			memcpy_s( entry->source, sourceSize, source, sourceSize );
+			entry->sourceSize = sourceSize;
+			entry->code = code;
+			entry->references = 1;
+
+			EnterCriticalSection( &s_cacheLock );
+			entry->next = s_cacheFirst;
+			if ( s_cacheFirst )
+				s_cacheFirst->previous = entry;
+			else
+				s_cacheLast = entry;
+			s_cacheFirst = entry;
+			s_cacheCount++;
+			evictEntries();
+			LeaveCriticalSection( &s_cacheLock );
+		}
+	}
+
+	LeaveCriticalSection( &s_compileLock );
+
+	return entry;
+}
+
+void releaseCode( cacheEntry_t* entry )
+{
+	EnterCriticalSection( &s_cacheLock );
+	entry->references--;
+	evictEntries();
+	LeaveCriticalSection( &s_cacheLock );
+}
+
+cacheEntry_t* findEntry( uint64_t hash, const char* source, int sourceSize )
+{
+	for ( cacheEntry_t* entry = s_cacheFirst; entry; entry = entry->next )
+	{
+		if ( entry->hash == hash && entry->sourceSize == sourceSize && memcmp( entry->source, source, sourceSize ) == 0 )
+		{
+			entry->references++;
+			moveToFront( entry );
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+void moveToFront( cacheEntry_t* entry )
+{
+	if ( entry == s_cacheFirst )
+	{
+		return;
+	}
+
+	entry->previous->next = entry->next;
+	if ( entry->next )
+		entry->next->previous = entry->previous;
+	else
+		s_cacheLast = entry->previous;
+
+	entry->previous = NULL;
+	entry->next = s_cacheFirst;
+	s_cacheFirst->previous = entry;
+	s_cacheFirst = entry;
+}
+
+void evictEntries()
+{
+	//Least recently used first, entries still running stay until their last release.
+	cacheEntry_t* entry = s_cacheLast;
+	while ( entry && s_cacheCount > SERVER_CACHE_ENTRIES )
+	{
+		cacheEntry_t* previous = entry->previous;
+
+		if ( entry->references == 0 )
+		{
+			if ( entry->previous )
+				entry->previous->next = entry->next;
+			else
+				s_cacheFirst = entry->next;
+			if ( entry->next )
+				entry->next->previous = entry->previous;
+			else
+				s_cacheLast = entry->previous;
+
+			freeMachineCode( entry->code );
+			free( entry->source );
+			free( entry );
+			s_cacheCount--;
+		}
+
+		entry = previous;
+	}
+}
+
+void* compileCode( const char* source )
+{
+	opcode_t* opcodes = compileSource( source );
+	if ( ! opcodes )
+	{
+		return NULL;
+	}
+
+	//Always fuelled, a client can ask for a limit and a lost client has its program stopped.
+	int codeSize;
+	unsigned char* machineCode = assemble( opcodes, &codeSize, ASM_FUEL_CHECKS );
+	free( opcodes );
+	if ( ! machineCode )
+	{
+		return NULL;
+	}
+
+	void* code = prepareMachineCode( machineCode, codeSize, 0, NULL );
+	free( machineCode );
+
+	return code;
+}
+
+uint64_t hashSource( const char* source, int size )
+{
+	//FNV-1a.
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for ( int i = 0; i < size; i++ )
+	{
+		hash ^= (unsigned char)source[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+DWORD WINAPI clientInput( LPVOID parameter )
+{
+	SOCKET server = (SOCKET)parameter;
+	HANDLE input = GetStdHandle( STD_INPUT_HANDLE );
+	char buffer[SERVER_BUFFER_SIZE];
+
+	DWORD size;
+	while ( ReadFile( input, buffer, sizeof( buffer ), &size, NULL ) && size > 0 )
+	{
+		if ( ! sendInput( server, buffer, size ) )
+		{
+			return 0;
+		}
+	}
+
+	sendInput( server, NULL, 0 );
+
+	return 0;
+}
+
+int sendInput( SOCKET server, const void* data, int size )
+{
+	EnterCriticalSection( &s_inputLock );
+	int sent = ! s_inputStopped && sendFrame( server, FRAME_INPUT, data, size );
+	LeaveCriticalSection( &s_inputLock );
+
+	return sent;
+}
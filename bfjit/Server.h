@@ -0,0 +1,22 @@
+#pragma once
+#ifndef SERVER_H
+#define SERVER_H
+
+//Clients look for a running server here, see the client mode in Main.c.
+#define SERVER_ENVIRONMENT "BFJIT_SERVER"
+
+//Statuses a request can end with besides the RunStatus values.
+#define SERVER_COMPILE_ERROR -1
+#define SERVER_CONNECTION_LOST -2
+
+//Listen on a Unix domain socket at path and run every program sent to it. Machine code is kept
+//in an LRU keyed by the source, workers each own a tape, 0 workers means one per processor.
+//A request is stopped when its client goes away or after timeoutMs, 0 for no time limit.
+//Only returns when the socket could not be set up.
+extern int serve( const char* path, int workers, uint32_t timeoutMs );
+
+//Run source on the server at path, stdin is streamed to it and its output written to stdout.
+//Returns 0 when no server answered, status is then untouched.
+extern int runRemote( const char* path, const char* source, int sourceSize, int64_t maxSteps, int* status );
+
+#endif
@@ -0,0 +1,520 @@
+#include "extern_data.h"
+#include "Assemble.h"
+#include "Compile.h"
+#include "Runtime.h"
+#include "Interpret.h"
+#include "Evaluate.h"
+#include "Analyse.h"
+#include "Cpu.h"
+#include "Verify.h"
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VERIFY_TAPE_SIZE 65536
+#define VERIFY_TAPE_MARGIN 4096 //Slack either side of the tape the interpreter may not touch.
+#define VERIFY_MAX_STEPS 1000000
+#define VERIFY_MAX_OUTPUT 65536
+#define VERIFY_MAX_INPUT 65536
+#define VERIFY_CANARY 0xa5 //Fills the cells the tape range analysis says are never touched.
+
+#define FUZZ_MAX_PROGRAM 2048
+#define FUZZ_MAX_DEPTH 5
+#define FUZZ_MAX_INPUT 16
+#define FUZZ_MAX_CONSTRUCT 64 //Most characters one generated construct can take, brackets included.
+
+typedef struct io_s
+{
+	const unsigned char* input;
+	int inputSize;
+	int inputIndex;
+
+	unsigned char* output;
+	int outputSize;
+} io_t;
+
+typedef struct reference_s
+{
+	unsigned char* tape;
+	int start;
+	unsigned char* output;
+	int outputSize;
+	int64_t steps;
+} reference_t;
+
+//One way of building the program, every configuration must match the interpreter.
+typedef struct configuration_s
+{
+	const char* name;
+	int partialEvaluate;
+	int assembleFlags;
+	int cpuLevel; //-1 for the level in use, otherwise skipped when the CPU lacks it.
+} configuration_t;
+
+typedef struct byteSource_s
+{
+	const unsigned char* data; //NULL for a pseudo random stream.
+	size_t size;
+	size_t index;
+	uint32_t state;
+} byteSource_t;
+
+static const configuration_t s_configurations[] =
+{
+	{ "default", 0, 0, -1 },
+	{ "partial_eval", 1, 0, -1 },
+	{ "scalar", 0, 0, CPU_LEVEL_SCALAR },
+	{ "sse2", 0, 0, CPU_LEVEL_SSE2 },
+	{ "avx2", 0, 0, CPU_LEVEL_AVX2 },
+	{ "avx512", 0, 0, CPU_LEVEL_AVX512 }
+};
+
+//The generated code calls plain getchar/putchar style functions, there is no room for a context.
+static io_t s_io;
+
+static int verifyGetChar( void );
+static int verifyPutChar( int c );
+static void resetIo( const unsigned char* input, int inputSize, unsigned char* output );
+static int wellBracketed( const char* text );
+static VerifyResult verifyConfiguration( const char* text, const configuration_t* configuration, const unsigned char* input, int inputSize, const reference_t* reference );
+static void reportMismatch( const char* text, const configuration_t* configuration, const char* reason, int index );
+
+static int nextByte( byteSource_t* source );
+static void generateProgram( byteSource_t* source, char* text, int capacity );
+static int generateBlock( byteSource_t* source, char* text, int* length, int capacity, int reserve, int depth );
+static void emit( char* text, int* length, char c, int count );
+static void emitMoves( char* text, int* length, int amount );
+
+VerifyResult verifySource( const char* text, const unsigned char* input, int inputSize )
+{
+	if ( ! wellBracketed( text ) )
+	{
+		return VERIFY_SKIPPED;
+	}
+
+	int start = VERIFY_TAPE_MARGIN + (VERIFY_TAPE_SIZE - 2 * VERIFY_TAPE_MARGIN) / 2;
+
+	//Reference run first, it decides whether the program is worth running natively.
+	reference_t reference;
+	reference.start = start;
+	reference.tape = calloc( VERIFY_TAPE_SIZE, 1 );
+	reference.output = malloc( VERIFY_MAX_OUTPUT );
+	resetIo( input, inputSize, reference.output );
+
+	int64_t fuel = VERIFY_MAX_STEPS;
+	RunStatus status = interpret( text, reference.tape + VERIFY_TAPE_MARGIN, VERIFY_TAPE_SIZE - 2 * VERIFY_TAPE_MARGIN,
+		start - VERIFY_TAPE_MARGIN, verifyGetChar, verifyPutChar, &fuel );
+	reference.outputSize = s_io.outputSize;
+	reference.steps = VERIFY_MAX_STEPS - fuel;
+
+	VerifyResult result = status == RUN_OK ? VERIFY_MATCH : VERIFY_SKIPPED;
+
+	for ( int i = 0; i < _countof( s_configurations ) && result == VERIFY_MATCH; i++ )
+	{
+		result = verifyConfiguration( text, &s_configurations[i], input, inputSize, &reference );
+	}
+
+	free( reference.tape );
+	free( reference.output );
+
+	return result;
+}
+
+VerifyResult verifyConfiguration( const char* text, const configuration_t* configuration, const unsigned char* input, int inputSize, const reference_t* reference )
+{
+	if ( configuration->cpuLevel > (int)getSupportedCpuLevel() )
+	{
+		return VERIFY_MATCH;
+	}
+
+	opcode_t* opcodes = compileSource( text );
+	if ( ! opcodes )
+	{
+		reportMismatch( text, configuration, "compiler rejected a well bracketed program", 0 );
+		return VERIFY_MISMATCH;
+	}
+
+	if ( configuration->partialEvaluate )
+	{
+		//Only the cells right of the start, the rest of the tape is the interpreter's margin.
+		opcode_t* residual = partialEvaluate( opcodes, VERIFY_TAPE_SIZE - VERIFY_TAPE_MARGIN - reference->start, DEFAULT_EVALUATE_STEPS );
+		free( opcodes );
+		opcodes = residual;
+	}
+
+	tapeRange_t range;
+	analyseTapeRange( opcodes, &range );
+
+	CpuLevel level = getCpuLevel();
+	if ( configuration->cpuLevel >= 0 )
+	{
+		setCpuLevel( configuration->cpuLevel );
+	}
+
+	int codeSize;
+	unsigned char* machineCode = assemble( opcodes, &codeSize, configuration->assembleFlags | ASM_FUEL_CHECKS );
+	free( opcodes );
+	setCpuLevel( level );
+	void* executableCode = prepareMachineCode( machineCode, codeSize, 0, NULL );
+	free( machineCode );
+
+	//Cells outside the analysed range must come back untouched.
+	int64_t rangeBegin = range.minimum == RANGE_UNBOUNDED_LOW ? 0 : reference->start + range.minimum;
+	int64_t rangeEnd = range.maximum == RANGE_UNBOUNDED_HIGH ? VERIFY_TAPE_SIZE : reference->start + range.maximum + 1;
+	unsigned char* tape = malloc( VERIFY_TAPE_SIZE );
+	for ( int i = 0; i < VERIFY_TAPE_SIZE; i++ )
+	{
+		tape[i] = i >= rangeBegin && i < rangeEnd ? 0 : VERIFY_CANARY;
+	}
+	unsigned char* output = malloc( VERIFY_MAX_OUTPUT );
+	resetIo( input, inputSize, output );
+
+	//The JIT never takes more back-edges than the interpreter, running dry means it looped.
+	volatile int64_t fuel = reference->steps + 1;
+	RunStatus status = runMachineCode( executableCode, verifyGetChar, verifyPutChar, tape + reference->start, &fuel );
+	freeMachineCode( executableCode );
+
+	VerifyResult result = VERIFY_MATCH;
+
+	if ( status != RUN_OK )
+	{
+		reportMismatch( text, configuration, "JIT did not finish", 0 );
+		result = VERIFY_MISMATCH;
+	}
+	else if ( s_io.outputSize != reference->outputSize )
+	{
+		reportMismatch( text, configuration, "output size differs", s_io.outputSize );
+		result = VERIFY_MISMATCH;
+	}
+	else
+	{
+		for ( int i = 0; i < reference->outputSize && result == VERIFY_MATCH; i++ )
+		{
+			if ( output[i] != reference->output[i] )
+			{
+				reportMismatch( text, configuration, "output differs at byte", i );
+				result = VERIFY_MISMATCH;
+			}
+		}
+
+		for ( int i = 0; i < VERIFY_TAPE_SIZE && result == VERIFY_MATCH; i++ )
+		{
+			if ( (i < rangeBegin || i >= rangeEnd) && (tape[i] != VERIFY_CANARY || reference->tape[i] != 0) )
+			{
+				reportMismatch( text, configuration, "cell outside the analysed tape range touched", i - reference->start );
+				result = VERIFY_MISMATCH;
+			}
+			else if ( (i >= rangeBegin && i < rangeEnd) && tape[i] != reference->tape[i] )
+			{
+				reportMismatch( text, configuration, "tape differs at cell", i - reference->start );
+				result = VERIFY_MISMATCH;
+			}
+		}
+	}
+
+	free( tape );
+	free( output );
+
+	return result;
+}
+
+VerifyResult verifyFile( const char* filename, const char* inputFilename )
+{
+	int size;
+	char* text = getSourceText( filename, &size );
+	if ( ! text )
+	{
+		return VERIFY_SKIPPED;
+	}
+
+	//The input file, or whatever is on stdin, is fed to both runs.
+	FILE* inputFile = stdin;
+	if ( inputFilename )
+	{
+		inputFile = NULL;
+		fopen_s( &inputFile, inputFilename, "rb" );
+		if ( ! inputFile )
+		{
+			free( text );
+			return VERIFY_SKIPPED;
+		}
+	}
+
+	unsigned char* input = malloc( VERIFY_MAX_INPUT );
+	int inputSize = (int)fread( input, 1, VERIFY_MAX_INPUT, inputFile );
+
+	if ( inputFile != stdin )
+	{
+		fclose( inputFile );
+	}
+
+	VerifyResult result = verifySource( text, input, inputSize );
+
+	free( input );
+	free( text );
+
+	return result;
+}
+
+int fuzz( uint32_t seed, int iterations )
+{
+	byteSource_t source;
+	source.data = NULL;
+	source.size = 0;
+	source.index = 0;
+	source.state = seed ? seed : 1;
+
+	char* text = malloc( FUZZ_MAX_PROGRAM );
+	unsigned char input[FUZZ_MAX_INPUT];
+
+	int results[VERIFY_SKIPPED + 1] = { 0 };
+
+	for ( int i = 0; i < iterations; i++ )
+	{
+		generateProgram( &source, text, FUZZ_MAX_PROGRAM );
+
+		int inputSize = nextByte( &source ) % FUZZ_MAX_INPUT;
+		for ( int j = 0; j < inputSize; j++ )
+		{
+			input[j] = (unsigned char)nextByte( &source );
+		}
+
+		results[verifySource( text, input, inputSize )]++;
+	}
+
+	free( text );
+
+	printf( "%d programs: %d match, %d mismatch, %d skipped\n", iterations,
+		results[VERIFY_MATCH], results[VERIFY_MISMATCH], results[VERIFY_SKIPPED] );
+
+	return results[VERIFY_MISMATCH];
+}
+
+#ifdef BFJIT_FUZZER
+//libFuzzer entry point, the fuzz input steers the program generator so every case is well bracketed.
+int LLVMFuzzerTestOneInput( const uint8_t* data, size_t size )
+{
+	byteSource_t source;
+	source.data = data;
+	source.size = size;
+	source.index = 0;
+	source.state = 0;
+
+	char text[FUZZ_MAX_PROGRAM];
+	generateProgram( &source, text, FUZZ_MAX_PROGRAM );
+
+	const unsigned char input[] = "bfjit";
+	if ( verifySource( text, input, sizeof( input ) - 1 ) == VERIFY_MISMATCH )
+	{
+		abort();
+	}
+
+	return 0;
+}
+#endif
+
+int verifyGetChar( void )
+{
+	if ( s_io.inputIndex < s_io.inputSize )
+	{
+		return s_io.input[s_io.inputIndex++];
+	}
+	return EOF;
+}
+
+int verifyPutChar( int c )
+{
+	if ( s_io.outputSize < VERIFY_MAX_OUTPUT )
+	{
+		s_io.output[s_io.outputSize++] = (unsigned char)c;
+	}
+	return c;
+}
+
+void resetIo( const unsigned char* input, int inputSize, unsigned char* output )
+{
+	s_io.input = input;
+	s_io.inputSize = inputSize;
+	s_io.inputIndex = 0;
+	s_io.output = output;
+	s_io.outputSize = 0;
+}
+
+int wellBracketed( const char* text )
+{
+	int depth = 0;
+	for ( int i = 0; text[i] && depth >= 0; i++ )
+	{
+		if ( text[i] == '[' )
+		{
+			depth++;
+		}
+		else if ( text[i] == ']' )
+		{
+			depth--;
+		}
+	}
+	return depth == 0;
+}
+
+void reportMismatch( const char* text, const configuration_t* configuration, const char* reason, int index )
+{
+	fprintf( stderr, "MISMATCH (%s): %s %d\n%s\n", configuration->name, reason, index, text );
+}
+
+int nextByte( byteSource_t* source )
+{
+	if ( source->data )
+	{
+		return source->index < source->size ? source->data[source->index++] : -1;
+	}
+
+	//xorshift32
+	source->state ^= source->state << 13;
+	source->state ^= source->state >> 17;
+	source->state ^= source->state << 5;
+	return source->state & 0xff;
+}
+
+void generateProgram( byteSource_t* source, char* text, int capacity )
+{
+	int length = 0;
+	generateBlock( source, text, &length, capacity, 1, 0 );
+	text[length] = 0;
+}
+
+int generateBlock( byteSource_t* source, char* text, int* length, int capacity, int reserve, int depth )
+{
+	//Net pointer movement of the block, INT32_MIN once it is unknown.
+	int moved = 0;
+
+	//Room the enclosing loops need to balance and close, plus the largest single construct.
+	int pending = reserve + FUZZ_MAX_CONSTRUCT;
+
+	int byte;
+	while ( (byte = nextByte( source )) >= 0 && *length + pending < capacity )
+	{
+		int count = nextByte( source ) % 4 + 1;
+
+		switch ( byte % 16 )
+		{
+		case 0:
+		case 1:
+			emit( text, length, '+', count );
+			break;
+		case 2:
+		case 3:
+			emit( text, length, '-', count );
+			break;
+		case 4:
+			emit( text, length, '>', count );
+			moved = moved == INT32_MIN ? moved : moved + count;
+			break;
+		case 5:
+			emit( text, length, '<', count );
+			moved = moved == INT32_MIN ? moved : moved - count;
+			break;
+		case 6:
+			emit( text, length, '.', 1 );
+			break;
+		case 7:
+			emit( text, length, ',', 1 );
+			break;
+		case 8:
+			//Clear idioms.
+			emit( text, length, '[', 1 );
+			emit( text, length, count & 1 ? '-' : '+', 1 );
+			emit( text, length, ']', 1 );
+			break;
+		case 9:
+			{
+				//Transfer loop, [->+++<<-->] and friends.
+				emit( text, length, '[', 1 );
+				emit( text, length, '-', count & 1 ? 1 : 3 );
+				int offset = 0;
+				for ( int i = 0; i < count; i++ )
+				{
+					int step = nextByte( source ) % 7 - 3;
+					emitMoves( text, length, step );
+					offset += step;
+					emit( text, length, count & 2 ? '+' : '-', nextByte( source ) % 3 + 1 );
+				}
+				emitMoves( text, length, -offset );
+				emit( text, length, ']', 1 );
+			}
+			break;
+		case 10:
+			//Scan for a zero cell.
+			emit( text, length, '[', 1 );
+			emit( text, length, count & 1 ? '>' : '<', count / 2 + 1 );
+			emit( text, length, ']', 1 );
+			moved = INT32_MIN;
+			break;
+		case 11:
+		case 12:
+			if ( depth < FUZZ_MAX_DEPTH )
+			{
+				//Counted loop with a balanced body.
+				emit( text, length, '[', 1 );
+				emit( text, length, '-', 1 );
+				int inner = generateBlock( source, text, length, capacity, pending, depth + 1 );
+				if ( inner != INT32_MIN )
+				{
+					emitMoves( text, length, -inner );
+				}
+				emit( text, length, ']', 1 );
+			}
+			break;
+		case 13:
+			if ( depth < FUZZ_MAX_DEPTH )
+			{
+				//Runs at most once.
+				emit( text, length, '[', 1 );
+				int inner = generateBlock( source, text, length, capacity, pending, depth + 1 );
+				if ( inner != INT32_MIN )
+				{
+					emitMoves( text, length, -inner );
+				}
+				emit( text, length, '[', 1 );
+				emit( text, length, '-', 1 );
+				emit( text, length, ']', 1 );
+				emit( text, length, ']', 1 );
+			}
+			break;
+		case 14:
+			if ( depth < FUZZ_MAX_DEPTH )
+			{
+				//Anything goes, the step budget catches the ones that never end.
+				emit( text, length, '[', 1 );
+				generateBlock( source, text, length, capacity, pending, depth + 1 );
+				emit( text, length, ']', 1 );
+				moved = INT32_MIN;
+			}
+			break;
+		case 15:
+			if ( depth > 0 )
+			{
+				return moved;
+			}
+			break;
+		}
+
+		pending = reserve + FUZZ_MAX_CONSTRUCT + (moved == INT32_MIN ? 0 : abs( moved ));
+	}
+
+	return moved;
+}
+
+void emit( char* text, int* length, char c, int count )
+{
+	for ( int i = 0; i < count; i++ )
+	{
+		text[(*length)++] = c;
+	}
+}
+
+void emitMoves( char* text, int* length, int amount )
+{
+	emit( text, length, amount > 0 ? '>' : '<', abs( amount ) );
+}
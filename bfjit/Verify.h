@@ -0,0 +1,17 @@
+#pragma once
+#ifndef VERIFY_H
+#define VERIFY_H
+
+typedef enum VerifyResult
+{
+	VERIFY_MATCH,
+	VERIFY_MISMATCH,
+	VERIFY_SKIPPED //Not well bracketed, ran out of steps or left the tape in the interpreter.
+} VerifyResult;
+
+extern VerifyResult verifySource( const char* text, const unsigned char* input, int inputSize );
+//inputFilename NULL reads the input from stdin.
+extern VerifyResult verifyFile( const char* filename, const char* inputFilename );
+extern int fuzz( uint32_t seed, int iterations );
+
+#endif
@@ -4,6 +4,10 @@
 #include <stdint.h>
 
 #define MAX_STACK_SIZE 500
+#define MAX_MEMORY_SIZE 5000
+
+//Cells a vector op covers, one SSE2 register.
+#define VECTOR_CELLS 16
 
 typedef enum OpType
 {
@@ -20,6 +24,19 @@ typedef enum OpType
 	OP_INPUT_CHAR,
 	OP_OPEN_BRACKET,
 	OP_CLOSE_BRACKET,
+	OP_SET,
+	OP_OUTPUT_CONST,
+	OP_SCAN_RIGHT,
+	OP_SCAN_LEFT,
+	OP_LOOP_COUNT, //Trip count of a counted loop: counter * value.
+	OP_MUL_ADD, //Cell at offset += trip count * value.
+	OP_MUL_CELL, //Product = trip count * cell at offset * value.
+	OP_ADD_PRODUCT, //Cell at offset += product.
+	OP_IF_MASK, //Mask = cell != 0, for an if lowered without branches.
+	OP_IF_ADD, //Cell at offset += value when the mask is set.
+	OP_IF_SET, //Cell at offset = value when the mask is set.
+	OP_VECTOR_SET, //VECTOR_CELLS cells from offset = value.
+	OP_VECTOR_ADD, //VECTOR_CELLS cells from offset += value.
 	OP_CODE_END
 } OpType;
 
@@ -44,12 +61,29 @@ typedef enum ErrorType
 	ERR_NUM_ERRORS
 } ErrorType;
 
+typedef enum RunStatus
+{
+	RUN_OK,
+	RUN_LIMIT_REACHED,
+	RUN_TAPE_OVERFLOW
+} RunStatus;
+
 typedef struct opcode_s
 {
 	OpType type;
 	uint32_t value;
+	int32_t offset; //Cell the op works on relative to the pointer, OP_SET and the closed form loop, if and vector ops use it.
 } opcode_t;
 
+#define RANGE_UNBOUNDED_LOW INT64_MIN
+#define RANGE_UNBOUNDED_HIGH INT64_MAX
+
+typedef struct tapeRange_s
+{
+	int64_t minimum; //Lowest cell the program can touch relative to the start, or RANGE_UNBOUNDED_LOW.
+	int64_t maximum; //Highest cell, or RANGE_UNBOUNDED_HIGH.
+} tapeRange_t;
+
 typedef struct token_s
 {
 	TokType type;
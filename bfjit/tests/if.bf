@@ -0,0 +1,3 @@
+Loops that run at most once including ones too large for branchless code
+,[>+>++<<[-]]>.>.
+,[>+>+>+>+>+>+<<<<<<[-]]>.>.>.>.>.>.
@@ -0,0 +1,2 @@
+Input can make the cell non zero so the loop after it is live code
+,[.-]
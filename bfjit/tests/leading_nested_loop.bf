@@ -0,0 +1,4 @@
+A leading loop never runs and is dropped as dead code
+skipping it has to find the bracket that closes it rather than the first one it sees
+[[-]+[-]>]
+++++++++[>++++++++<-]>+.
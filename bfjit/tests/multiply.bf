@@ -0,0 +1,3 @@
+Transfer and multiply loops then nested counted loops in closed form
++++++[>+++>++++++>+<<<-]>.>.>.
+++++[>+++[>++<-]<-]>>.
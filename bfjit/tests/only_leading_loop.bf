@@ -0,0 +1,2 @@
+A program made only of a dead leading loop is still well bracketed
+[.+]
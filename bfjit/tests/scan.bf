@@ -0,0 +1,3 @@
+Scans over zero and non zero runs in both directions
++>+>+>+>+>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>+<
+[<]<[<]>[>]>[>]>[-]<<<<<[[-]<].
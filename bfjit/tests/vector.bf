@@ -0,0 +1,4 @@
+Uniform updates over runs of neighbouring cells
++>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+>+
+<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<[[-]>]
+>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++>+++.